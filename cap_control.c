@@ -15,6 +15,7 @@
 #include "cap_control.h"
 
 #include "wiring_serial.h"
+#include "report.h"
 
 #define NZEROS 5
 #define NPOLES 5
@@ -219,50 +220,26 @@ void cc_measure_cap(int selection)
 	st_synchronize();
 	if(selection == 0 || selection == -2)
 	{
-		printPgmString(PSTR("X Axis Val: "));
-		if( cc_axisAverageCapValue( X_AXIS, 10*5 ) == 0)
-		{
-			printFloat(capAverage);
-		} else {
-			print_timed_out();
-		}
-		print_newline();
+		int timed_out = cc_axisAverageCapValue( X_AXIS, 10*5 ) != 0;
+		report_cap_value(PSTR("X Axis Val: "), timed_out, capAverage);
 	}
 	
 	if(selection == 1 || selection == -2)
 	{
-		printPgmString(PSTR("Y Axis Val: "));
-		if( cc_axisAverageCapValue(Y_AXIS, 10*5 ) == 0)
-		{
-			printFloat(capAverage);
-		} else {
-			print_timed_out();
-		}
-		print_newline();
+		int timed_out = cc_axisAverageCapValue(Y_AXIS, 10*5 ) != 0;
+		report_cap_value(PSTR("Y Axis Val: "), timed_out, capAverage);
 	}
 	
 	if(selection == 2 || selection == -2)
 	{
-		printPgmString(PSTR("Z Axis Val: "));
-		if( cc_axisAverageCapValue(Z_AXIS, 10*5 ) == 0)
-		{
-			printFloat(capAverage);
-		} else {
-			print_timed_out();
-		}
-		print_newline();
+		int timed_out = cc_axisAverageCapValue(Z_AXIS, 10*5 ) != 0;
+		report_cap_value(PSTR("Z Axis Val: "), timed_out, capAverage);
 	}
 	
 	if(selection == -1 || selection == -2)
 	{
-		printPgmString(PSTR("End Mill Val: "));
-		if( cc_endMillAverageCapValue( 10*5 ) == 0)
-		{
-			printFloat(capAverage);
-		} else {
-			print_timed_out();
-		}
-		print_newline();
+		int timed_out = cc_endMillAverageCapValue( 10*5 ) != 0;
+		report_cap_value(PSTR("End Mill Val: "), timed_out, capAverage);
 	}
 }
 
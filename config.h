@@ -25,6 +25,13 @@
 
 //#define BAUD_RATE 9600
 
+// The largest error, in 1/1000 of the rate, of a baud rate that $19 accepts. The UART samples each bit in
+// the middle, so the error on both ends together must stay below about 4%.
+#define SERIAL_MAX_BAUD_ERROR 40
+
+// How long a new baud rate set with $19 waits for the host to confirm it before going back to the old one
+#define BAUD_RATE_TRIAL_MS 2000
+
 // Updated default pin-assignments from 0.6 onwards 
 // (see bottom of file for a copy of the old config)
 
@@ -57,9 +64,42 @@
 //#define SPINDLE_DIRECTION_PORT PORTB
 //#define SPINDLE_DIRECTION_BIT 5
 
-// The temporal resolution of the acceleration management subsystem. Higher number
-// give smoother acceleration but may impact performance
-#define ACCELERATION_TICKS_PER_SECOND 40L
+// The number of linear motions that can be in the plan at any give time, up to 32. Every block takes 
+// sizeof(block_t)+sizeof(block_plan_t) bytes of SRAM. '$$' prints the sizes and the free SRAM.
+// On the 328p the static data takes about 1740 of the 2048 bytes at 16 blocks: 752 for the plan, 181 for 
+// the arc chords, 144 for the step segments and 320 for the serial buffers and the line. The other 300 or so
+// are the stack for the parser, the arc planner and the stepper interrupt on top of them. 20 blocks would 
+// leave it 120.
+#ifdef __AVR_ATmega328P__
+#define BLOCK_BUFFER_SIZE 16
+#else
+#define BLOCK_BUFFER_SIZE 4
+#endif
+
+// The number of step segments prepared ahead of the stepper interrupt. Each holds one acceleration, cruise or
+// deceleration phase of a block.
+#define SEGMENT_BUFFER_SIZE 6
+
+// Spread the steps of the minor axes evenly at low step rates by running the stepper interrupt and the
+// line tracer at up to 8 times the step rate. Comment out to step at the step rate only.
+#define ADAPTIVE_MULTI_AXIS_STEP_SMOOTHING
+
+// From this step rate in step_events/minute the stepper interrupt traces 2 step events per interrupt, and from 
+// twice this rate 4, with timer 2 spacing out the extra pulses. Must be at least 8000 steps/second so the step
+// interval fits timer 2. Comment out to trace one step event per interrupt.
+#define MULTI_STEP_RATE (10000L*60)
+
+// An arc takes one block in the plan. The planner cuts it into chords as the stepper needs them and keeps up 
+// to one less than this many chords ahead of the stepper interrupt.
+#define CHORD_BUFFER_SIZE 4
+
+// The arc generator turns the radius vector by a rotation matrix for each chord instead of calling sin() and
+// cos(). Rounding errors add up with every turn, so every this many chords it computes the vector exactly.
+#define N_ARC_CORRECTION 25
+
+// Use integer speeds squared and fixed point fractions for the lookahead and the trapezoid math instead 
+// of software floating point. Comment out to use the floating point planner.
+#define PLANNER_FIXED_POINT
 
 #endif
 
@@ -32,6 +32,7 @@
 #include "errno.h"
 #include "serial_protocol.h"
 #include "cap_control.h"
+#include "report.h"
 
 #define MM_PER_INCH (25.4)
 
@@ -82,12 +83,23 @@ static parser_state_t gc;
 
 #define FAIL(status) gc.status_code = status;
 
+// The most words one line of g-code may hold
+#define MAX_WORDS_PER_LINE 16
+
+// One word of a line of g-code, e.g. 'X' and 12.5 for "X12.5"
+typedef struct {
+  char letter;
+  double value;
+} word_t;
+
 int read_double(char *line,               //  <- string: line of RS274/NGC code being processed
                      int *char_counter,        //  <- pointer to a counter for position on the line 
                      double *double_ptr); //  <- pointer to double to be read                  
 
 int next_statement(char *letter, double *double_ptr, char *line, int *char_counter);
 
+static uint8_t gc_execute_words(word_t *words, uint8_t word_count, uint8_t absolute_mm);
+
 
 void select_plane(uint8_t axis_0, uint8_t axis_1, uint8_t axis_2) 
 {
@@ -129,19 +141,120 @@ double theta(double x, double y)
 // characters and signed floating point values (no whitespace).
 uint8_t gc_execute_line(char *line) {
   int char_counter = 0;  
+  double value;
+  double p = 0;
+  word_t words[MAX_WORDS_PER_LINE];
+  uint8_t word_count = 0;
+
+  gc.status_code = GCSTATUS_OK;
+  
+  // Disregard comments and block delete
+  if (line[0] == '(') { return(gc.status_code); }
+  if (line[0] == '/') { char_counter++; } // ignore block delete  
+  
+  // If the line starts with an '$' it is a configuration-command
+  if (line[0] == '$') { 
+    // Parameter lines are on the form '$4=374.3' or '$' to dump current settings
+    char_counter = 1;
+    if(line[char_counter] == '$') { report_build_info(); return(GCSTATUS_OK); }
+    if(line[char_counter] == 'U') { report_serial_health(); return(GCSTATUS_OK); }
+    if(line[char_counter] == 0) { report_settings(); return(GCSTATUS_OK); }
+    read_double(line, &char_counter, &p);
+    if(line[char_counter++] != '=') { return(GCSTATUS_UNSUPPORTED_STATEMENT); }
+    read_double(line, &char_counter, &value);
+    if(line[char_counter] != 0) { return(GCSTATUS_UNSUPPORTED_STATEMENT); }
+    if (!settings_store_setting(p, value)) { return(GCSTATUS_UNSUPPORTED_STATEMENT); }
+    plan_load_settings();
+    return(gc.status_code);
+  }
+  
+  /* We'll handle this as g-code. First: parse all statements once into the word array */
+  while(line[char_counter] != 0) {
+    if (word_count == MAX_WORDS_PER_LINE) { FAIL(GCSTATUS_TOO_MANY_WORDS); break; }
+    if (!next_statement(&words[word_count].letter, &words[word_count].value, line, &char_counter)) { break; }
+    word_count++;
+  }
+  if (gc.status_code) { return(gc.status_code); }
+  return(gc_execute_words(words, word_count, FALSE));
+}
+
+// Reads an unsigned LEB128 varint from the frame. Returns FALSE if it runs past the end.
+static uint8_t read_varint(uint8_t *frame, uint8_t length, uint8_t *index, uint32_t *value) {
+  uint8_t shift = 0;
+  *value = 0;
+  for (;;) {
+    if (*index == length || shift > 28) { return(FALSE); }
+    uint8_t byte = frame[(*index)++];
+    *value |= (uint32_t)(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) { return(TRUE); }
+    shift += 7;
+  }
+}
+
+// Reads a zigzag encoded signed varint from the frame
+static uint8_t read_signed_varint(uint8_t *frame, uint8_t length, uint8_t *index, int32_t *value) {
+  uint32_t zigzag;
+  if (!read_varint(frame, length, index, &zigzag)) { return(FALSE); }
+  *value = (zigzag >> 1) ^ -(int32_t)(zigzag & 1);
+  return(TRUE);
+}
+
+uint8_t gc_execute_frame(uint8_t *frame, uint8_t length) {
+  word_t words[7];
+  uint8_t word_count = 0;
+  uint8_t index = 1;
+  uint8_t axis;
+  int32_t micrometers;
+  uint32_t feed_rate;
+  
+  if (length == 0) { return(GCSTATUS_BAD_FRAME); }
+  uint8_t opcode = frame[0];
+  // The deltas are in the parser's units, so inverse time feed rates are not supported
+  if (gc.inverse_feed_rate_mode) { return(GCSTATUS_UNSUPPORTED_STATEMENT); }
+  words[word_count].letter = 'G';
+  words[word_count++].value = opcode & FRAME_MOTION_MASK;
+  for (axis = X_AXIS; axis <= Z_AXIS; axis++) {
+    if (opcode & (FRAME_X << axis)) {
+      if (!read_signed_varint(frame, length, &index, &micrometers)) { return(GCSTATUS_BAD_FRAME); }
+      // Add the delta in whole micrometers so rounding never accumulates
+      words[word_count].letter = 'X'+axis;
+      words[word_count++].value = (lround(gc.position[axis]*1000)+micrometers)/1000.0;
+    }
+  }
+  if (opcode & FRAME_F) {
+    if (!read_varint(frame, length, &index, &feed_rate)) { return(GCSTATUS_BAD_FRAME); }
+    words[word_count].letter = 'F';
+    words[word_count++].value = feed_rate;
+  }
+  for (axis = 0; axis < 2; axis++) {
+    if (opcode & (FRAME_I << axis)) {
+      if (!read_signed_varint(frame, length, &index, &micrometers)) { return(GCSTATUS_BAD_FRAME); }
+      words[word_count].letter = 'I'+axis;
+      words[word_count++].value = micrometers/1000.0;
+    }
+  }
+  if (index != length) { return(GCSTATUS_BAD_FRAME); }
+  gc.status_code = GCSTATUS_OK;
+  return(gc_execute_words(words, word_count, TRUE));
+}
+
+// Executes the words of one block. With absolute_mm the coordinates are absolute millimeters whatever the 
+// parser's distance and unit modes.
+static uint8_t gc_execute_words(word_t *words, uint8_t word_count, uint8_t absolute_mm) {
   char letter;
   double value;
   double unit_converted_value;
   double inverse_feed_rate = -1; // negative inverse_feed_rate means no inverse_feed_rate specified
   int radius_mode = FALSE;
   
-  uint8_t absolute_override = FALSE;          /* 1 = absolute motion for this block only {G53} */
+  uint8_t absolute_override = absolute_mm;    /* 1 = absolute motion for this block only {G53} */
   uint8_t next_action = NEXT_ACTION_DEFAULT;  /* The action that will be taken by the parsed line */
   
   double target[3], offset[3];  
   
   double p = 0, r = 0;
   int int_value;
+  uint8_t i;
 
 	double homing_dist_to_move = 0;
 	double homing_threshold = 0;
@@ -151,30 +264,10 @@ uint8_t gc_execute_line(char *line) {
   clear_vector(target);
   clear_vector(offset);
 
-  gc.status_code = GCSTATUS_OK;
-  
-  // Disregard comments and block delete
-  if (line[0] == '(') { return(gc.status_code); }
-  if (line[0] == '/') { char_counter++; } // ignore block delete  
-  
-  // If the line starts with an '$' it is a configuration-command
-  if (line[0] == '$') { 
-    // Parameter lines are on the form '$4=374.3' or '$' to dump current settings
-    char_counter = 1;
-    if(line[char_counter] == '$') { sp_millInfo(); return(GCSTATUS_OK); }
-    if(line[char_counter] == 0) { settings_dump(); return(GCSTATUS_OK); }
-    read_double(line, &char_counter, &p);
-    if(line[char_counter++] != '=') { return(GCSTATUS_UNSUPPORTED_STATEMENT); }
-    read_double(line, &char_counter, &value);
-    if(line[char_counter] != 0) { return(GCSTATUS_UNSUPPORTED_STATEMENT); }
-    settings_store_setting(p, value);
-    return(gc.status_code);
-  }
-  
-  /* We'll handle this as g-code. First: parse all statements */
-
   // Pass 1: Commands
-  while(next_statement(&letter, &value, line, &char_counter)) {
+  for (i = 0; i < word_count; i++) {
+    letter = words[i].letter;
+    value = words[i].value;
     int_value = trunc(value);
     switch(letter) {
       case 'G':
@@ -256,16 +349,17 @@ uint8_t gc_execute_line(char *line) {
   // If there were any errors parsing this line, we will return right away with the bad news
   if (gc.status_code) { return(gc.status_code); }
 
-  char_counter = 0;
   clear_vector(offset);
   memcpy(target, gc.position, sizeof(target)); // i.e. target = gc.position
 
   double homing_feed_rate = gc.feed_rate;
 	
   // Pass 2: Parameters
-  while(next_statement(&letter, &value, line, &char_counter)) {
+  for (i = 0; i < word_count; i++) {
+    letter = words[i].letter;
+    value = words[i].value;
     int_value = trunc(value);
-    unit_converted_value = to_millimeters(value);
+    unit_converted_value = absolute_mm ? value : to_millimeters(value);
     switch(letter) {
 	// Feed rate
       case 'F': 
@@ -313,18 +407,10 @@ uint8_t gc_execute_line(char *line) {
   // If there were any errors parsing this line, we will return right away with the bad news
   if (gc.status_code) { return(gc.status_code); }
     
-  // Update spindle state
+  // Update spindle state. Queued behind the motion so far, the parser goes on buffering.
 	if(spindle_changed)
 	{
-	  if (gc.spindle_direction) {
-		  // synchronize (get the mill head to catch up with where we think we are)
-		  mc_dwell(0);
-		  spindle_run(gc.spindle_direction, gc.spindle_speed);
-	  } else {
-		  // synchronize (get the mill head to catch up with where we think we are)
-		  mc_dwell(0);
-		  spindle_stop();
-	  }
+	  mc_spindle(gc.spindle_direction);
 	}
   
 	//TODO_MM - ensure that anything that clears out the position to 0,0,0 in motion_contrl
@@ -337,7 +423,6 @@ uint8_t gc_execute_line(char *line) {
   		  target[(int)trunc(p)] = 0;
 		  break;
 	  case NEXT_ACTION_MILL_GO_HOME: 
-		  mc_dwell(0);
 		  mc_do_mill_homing_with_params(homing_feed_rate, homing_dist_to_move, homing_threshold, homing_max_number_of_times, gc.position);
   		  target[2] = 0;
 		  break;		  
@@ -497,10 +582,7 @@ uint8_t gc_execute_line(char *line) {
       // Trace the arc
       mc_arc(theta_start, angular_travel, radius, depth, gc.plane_axis_0, gc.plane_axis_1, gc.plane_axis_2, 
         (gc.inverse_feed_rate_mode) ? inverse_feed_rate : gc.feed_rate, gc.inverse_feed_rate_mode,
-        gc.position);
-      // Finish off with a line to make sure we arrive exactly where we think we are
-      plan_buffer_line(target[X_AXIS], target[Y_AXIS], target[Z_AXIS], 
-        (gc.inverse_feed_rate_mode) ? inverse_feed_rate : gc.feed_rate, gc.inverse_feed_rate_mode);
+        gc.position, target);
       break;
 #endif      
     }    
@@ -533,20 +615,54 @@ int next_statement(char *letter, double *double_ptr, char *line, int *char_count
   return(1);
 }
 
+// Reads a decimal number like "-12.345" or "+.5" (no exponent) and leaves the counter on the first character
+// following it. The digits are gathered in an integer, keeping the 9 most significant, so the conversion 
+// to double takes only a few multiplications and one division. Much smaller and faster than strtod().
 int read_double(char *line,               //!< string: line of RS274/NGC code being processed
                      int *char_counter,   //!< pointer to a counter for position on the line 
                      double *double_ptr)  //!< pointer to double to be read                  
 {
-  char *start = line + *char_counter;
-  char *end;
+  char *ptr = line + *char_counter;
+  uint32_t digits = 0;
+  uint8_t digit_count = 0;
+  int16_t exponent = 0;
+  uint8_t negative = FALSE;
+  uint8_t decimal = FALSE;
   
-  *double_ptr = strtod(start, &end);
-  if(end == start) { 
+  if (*ptr == '-') { negative = TRUE; ptr++; }
+  else if (*ptr == '+') { ptr++; }
+  for (;;) {
+    uint8_t digit = *ptr - '0';
+    if (digit <= 9) {
+      digit_count++;
+      if (digits < 100000000) {
+        digits = digits*10 + digit;
+        if (decimal) { exponent--; }
+      } else if (!decimal) {
+        exponent++; // Drop the digit, but keep its magnitude
+      }
+    } else if (*ptr == '.' && !decimal) {
+      decimal = TRUE;
+    } else {
+      break;
+    }
+    ptr++;
+  }
+  if(digit_count == 0) { 
     FAIL(GCSTATUS_BAD_NUMBER_FORMAT); 
     return(FALSE); 
   };
 
-  *char_counter = end - line;
+  double value = digits;
+  if (exponent < 0) {
+    double divisor = 10;
+    while (++exponent < 0) { divisor *= 10; }
+    value /= divisor;
+  } else {
+    while (exponent-- > 0) { value *= 10; }
+  }
+  *double_ptr = negative ? -value : value;
+  *char_counter = ptr - line;
   return(TRUE);
 }
 
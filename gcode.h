@@ -28,6 +28,24 @@
 #define GCSTATUS_EXPECTED_COMMAND_LETTER 2
 #define GCSTATUS_UNSUPPORTED_STATEMENT 3
 #define GCSTATUS_FLOATING_POINT_ERROR 4
+#define GCSTATUS_TOO_MANY_WORDS 5
+#define GCSTATUS_BAD_FRAME 6
+#define GCSTATUS_LINE_TOO_LONG 7
+
+// The payload of a binary motion frame (see serial_protocol.h for the framing) is an opcode byte followed
+// by the fields its bits announce, in this order:
+//   X, Y, Z  the change of the target from the parser's position in micrometers, zigzag varint
+//   F        the feed rate in mm/min, varint
+//   I, J     the arc center offsets in micrometers, zigzag varint
+// Varints are little endian base 128 (LEB128). Zigzag maps 0,-1,1,-2,... to 0,1,2,3,... Frames always use
+// millimeters, whatever G20/G21 and G90/G91 say.
+#define FRAME_MOTION_MASK 0x03 // The motion mode: 0 to 3 for G0 to G3
+#define FRAME_X (1<<2)
+#define FRAME_Y (1<<3)
+#define FRAME_Z (1<<4)
+#define FRAME_F (1<<5)
+#define FRAME_I (1<<6)
+#define FRAME_J (1<<7)
 
 // Initialize the parser
 void gc_init();
@@ -35,4 +53,7 @@ void gc_init();
 // Execute one block of rs275/ngc/g-code
 uint8_t gc_execute_line(char *line);
 
+// Execute the payload of one binary motion frame
+uint8_t gc_execute_frame(uint8_t *frame, uint8_t length);
+
 #endif
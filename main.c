@@ -38,8 +38,8 @@
 int main(void)
 {
   sp_init_must_be_first();	
-  sp_init();        
   settings_init();  
+  sp_init();        
   plan_init();      
   st_init();        
   spindle_init();   
@@ -47,6 +47,7 @@ int main(void)
   cc_init();        
                     
   for(;;){
+    st_prep_buffer(); // Keep the stepper fed
     sleep_mode(); // Wait for it ...
     sp_process(); // ... process the serial protocol
   }
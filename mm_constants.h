@@ -14,6 +14,8 @@
 // in a setup packet after the version info
 #define LINE_BUFFER_SIZE 128
 
+// The default baud rate, and the fallback when the stored one ($19) is unusable. 115200 used to be 
+// unreliable, but the UART now uses the baud doubler where that is more accurate.
 //#define BAUD_RATE 9600
 #define BAUD_RATE 57600
 // every baud rate above this line worked when tested
@@ -84,6 +86,13 @@
 #define DEFAULT_FEEDRATE (381.0) 
 
 #define DEFAULT_ACCELERATION 7.0
+#define DEFAULT_X_ACCELERATION DEFAULT_ACCELERATION
+#define DEFAULT_Y_ACCELERATION DEFAULT_ACCELERATION
+#define DEFAULT_Z_ACCELERATION DEFAULT_ACCELERATION
+// in millimeters per min
+#define DEFAULT_X_MAX_RATE 3000.0
+#define DEFAULT_Y_MAX_RATE 3000.0
+#define DEFAULT_Z_MAX_RATE 3000.0
 
 // Use this line for default operation (step-pulses high)
 // #define STEPPING_INVERT_MASK 0
@@ -32,61 +32,72 @@
 #include "wiring_serial.h"
 
 #include "cap_control.h"
+#include "report.h"
+
+static uint8_t homing; // TRUE while a homing cycle runs
+
+uint8_t mc_is_homing()
+{
+  return(homing);
+}
 
 void mc_dwell(uint32_t milliseconds) 
 {
-  st_synchronize();
-  _delay_ms(milliseconds);
+  plan_buffer_command(BLOCK_DWELL, milliseconds);
+}
+
+void mc_spindle(int direction)
+{
+  plan_buffer_command(direction ? BLOCK_SPINDLE_RUN : BLOCK_SPINDLE_STOP, MOTOR_SPIN_UP_AND_DOWN_TIME);
 }
 
 // Execute an arc. theta == start angle, angular_travel == number of radians to go along the arc,
 // positive angular_travel means clockwise, negative means counterclockwise. Radius == the radius of the
 // circle in millimeters. axis_1 and axis_2 selects the circle plane in tool space. Stick the remaining
 // axis in axis_l which will be the axis for linear travel if you are tracing a helical motion.
-// position is a pointer to a vector representing the current position in millimeters.
+// position is a pointer to a vector representing the current position in millimeters, target to the end of the arc.
 
 #ifdef __AVR_ATmega328P__
-// The arc is approximated by generating a huge number of tiny, linear segments. The length of each 
-// segment is configured in settings.mm_per_arc_segment.  
+// The arc is approximated by a huge number of tiny, linear segments. Their length follows the
+// radius so that they stray at most settings.arc_tolerance from the circle, or if that is 0, it is 
+// settings.mm_per_arc_segment. The whole arc takes one block in the plan, and the planner cuts the 
+// segments from it as the stepper needs them. The lookahead ramps into and out of the arc as into a line.  
 void mc_arc(double theta, double angular_travel, double radius, double linear_travel, int axis_1, int axis_2, 
-  int axis_linear, double feed_rate, int invert_feed_rate, double *position)
+  int axis_linear, double feed_rate, int invert_feed_rate, double *position, double *target)
 {      
-  int acceleration_manager_was_enabled = plan_is_acceleration_manager_enabled();
-	if(acceleration_manager_was_enabled == TRUE)
-	{
-		plan_set_acceleration_manager_enabled(FALSE); // disable acceleration management for the duration of the arc
-	}
-  double millimeters_of_travel = hypot(angular_travel*radius, labs(linear_travel));
+  double planar_travel = fabs(angular_travel*radius);
+  double millimeters_of_travel = hypot(planar_travel, fabs(linear_travel));
   if (millimeters_of_travel == 0.0) { return; }
-  uint16_t segments = ceil(millimeters_of_travel/settings.mm_per_arc_segment);
-  // Multiply inverse feed_rate to compensate for the fact that this movement is approximated
-  // by a number of discrete segments. The inverse feed_rate should be correct for the sum of 
-  // all segments.
-  if (invert_feed_rate) { feed_rate *= segments; }
-  // The angular motion for each segment
-  double theta_per_segment = angular_travel/segments;
-  // The linear motion for each segment
-  double linear_per_segment = linear_travel/segments;
-  // Compute the center of this circle
-  double center_x = position[axis_1]-sin(theta)*radius;
-  double center_y = position[axis_2]-cos(theta)*radius;
-  // a vector to track the end point of each segment
-  double target[3];
-  int i;
-  // Initialize the linear axis
-  target[axis_linear] = position[axis_linear];
-  for (i=0; i<=segments; i++) {
-    target[axis_linear] += linear_per_segment;
-    theta += theta_per_segment;
-    target[axis_1] = center_x+sin(theta)*radius;
-    target[axis_2] = center_y+cos(theta)*radius;
-    plan_buffer_line(target[X_AXIS], target[Y_AXIS], target[Z_AXIS], feed_rate, invert_feed_rate);
+  double chords;
+  if (settings.arc_tolerance > 0) {
+    // The longest chord that strays no more than the tolerance from the circle: few segments on large radii,
+    // short ones on small radii
+    double tolerance = min(settings.arc_tolerance, radius);
+    chords = ceil(planar_travel/(2*sqrt(tolerance*(2*radius-tolerance))));
+  } else {
+    chords = ceil(millimeters_of_travel/settings.mm_per_arc_segment);
   }
-	
-  if(acceleration_manager_was_enabled == TRUE)
-  {
-	  plan_set_acceleration_manager_enabled(acceleration_manager_was_enabled);
+  // Clamp before the cast: a long arc at a fine tolerance or $6 can ask for more chords than fit in
+  // 16 bits, and a wrapped count would cut a few huge chords. A zero radius helix gives no count at all.
+  uint16_t segments;
+  if (chords > 0xffff) { segments = 0xffff; }
+  else if (chords >= 1) { segments = chords; }
+  else { segments = 1; }
+  // An inverse feed_rate is the time for the whole arc. Turn it into the speed along the arc in mm/sec
+  // so it can be limited below.
+  if (invert_feed_rate) { 
+    feed_rate = millimeters_of_travel*feed_rate/60; 
+    invert_feed_rate = FALSE;
   }
+  // Keep the centripetal acceleration v^2/r within the acceleration of the axes of the plane
+  double acceleration = min(settings.acceleration, 
+    min(settings.max_acceleration[axis_1], settings.max_acceleration[axis_2]));
+  double max_feed_rate = sqrt(acceleration*radius);
+  if (max_feed_rate > 0 && feed_rate > max_feed_rate) { feed_rate = max_feed_rate; }
+  // The center of the circle. The planner traces the arc from the current position around it.
+  double center_axis_1 = position[axis_1]-sin(theta)*radius;
+  double center_axis_2 = position[axis_2]-cos(theta)*radius;
+  plan_buffer_arc(center_axis_1, center_axis_2, angular_travel, segments, axis_1, axis_2, target, feed_rate);
 }
 #endif
 
@@ -100,6 +111,7 @@ void mc_do_homing_with_params(int axis, double feedRate, double moveVal, double
 {
 	int acceleration_manager_was_enabled = plan_is_acceleration_manager_enabled();
 	plan_set_acceleration_manager_enabled(FALSE); // disable acceleration management for the duration of the homing
+	homing = TRUE;
 	uint8_t isTimedOut = FALSE;
 	st_synchronize();
 	if( cc_axisAverageCapValue(axis, 10*5 ) != 0)
@@ -131,9 +143,7 @@ void mc_do_homing_with_params(int axis, double feedRate, double moveVal, double
 		}
 	}
 	
-	printString("TimesMoved = ");
-	printInteger(numTimesMoved);
-	print_newline();
+	report_debug_value(PSTR("TimesMoved = "), numTimesMoved);
 	
 	position[axis] = 0;
 	if(axis == 0)
@@ -145,12 +155,14 @@ void mc_do_homing_with_params(int axis, double feedRate, double moveVal, double
 		plan_redefine_current_position(position[X_AXIS], position[Y_AXIS], 0);
 	}
 	plan_set_acceleration_manager_enabled(acceleration_manager_was_enabled);
+	homing = FALSE;
 }
 
 void mc_do_mill_homing_with_params(double feedRate, double moveVal, double thresholdToStop, uint16_t maxNumTimesToMove, double *position)
 {
 	int acceleration_manager_was_enabled = plan_is_acceleration_manager_enabled();
 	plan_set_acceleration_manager_enabled(FALSE); // disable acceleration management for the duration of the homing
+	homing = TRUE;
 	// axis is always z
 	int axis = Z_AXIS;
 	uint8_t isTimedOut = FALSE;
@@ -175,14 +187,13 @@ void mc_do_mill_homing_with_params(double feedRate, double moveVal, double thres
 		}
 	}
 	
-	printString("TimesMoved = ");
-	printInteger(numTimesMoved);
-	print_newline();
+	report_debug_value(PSTR("TimesMoved = "), numTimesMoved);
 	
 	position[axis] = 0;
 	plan_redefine_current_position(position[X_AXIS], position[Y_AXIS], 0);
 	
 	plan_set_acceleration_manager_enabled(acceleration_manager_was_enabled);
+	homing = FALSE;
 }
 
 void mc_cur_pos_is_origin(int selection, double *position)
@@ -35,14 +35,19 @@
 // Execute an arc. theta == start angle, angular_travel == number of radians to go along the arc,
 // positive angular_travel means clockwise, negative means counterclockwise. Radius == the radius of the
 // circle in millimeters. axis_1 and axis_2 selects the circle plane in tool space. Stick the remaining
-// axis in axis_l which will be the axis for linear travel if you are tracing a helical motion.
+// axis in axis_l which will be the axis for linear travel if you are tracing a helical motion. The arc 
+// ends on target and takes one planner block.
 void mc_arc(double theta, double angular_travel, double radius, double linear_travel, int axis_1, int axis_2, 
-  int axis_linear, double feed_rate, int invert_feed_rate, double *position);
+  int axis_linear, double feed_rate, int invert_feed_rate, double *position, double *target);
 #endif
   
-// Dwell for a couple of time units
+// Dwell for a couple of time units. Queued with the motion, the stepper waits once the motion before is done.
 void mc_dwell(uint32_t milliseconds);
 
+// Switches the spindle on (direction 1) or off (0) once the motion before is done, and waits for it to spin 
+// up or down before the motion after it starts. Queued like mc_dwell().
+void mc_spindle(int direction);
+
 // Send the tool home (not implemented)
 // void mc_go_home();
 
@@ -51,4 +56,7 @@ void mc_do_mill_homing_with_params(double feedRate, double moveVal, double thres
 
 void mc_cur_pos_is_origin(int selection, double *position);
 
+// Returns TRUE while a homing cycle runs
+uint8_t mc_is_homing();
+
 #endif
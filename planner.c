@@ -33,7 +33,7 @@
   Distance to reach a specific speed with a constant acceleration:
 
     Solve[{Speed[s, a, t] == m, Travel[s, a, t] == d}, d, t]
-      d -> (m^2 - s^2)/(2 a) --> estimate_acceleration_distance()
+      d -> (m^2 - s^2)/(2 a)
 
   Speed after a given distance of travel with constant acceleration:
 
@@ -46,12 +46,18 @@
   from initial speed s1 without ever stopping at a plateau:
 
     Solve[{DestinationSpeed[s1, a, di] == DestinationSpeed[s2, a, d - di]}, di]
-      di -> (2 a d - s1^2 + s2^2)/(4 a) --> intersection_distance()
+      di -> (2 a d - s1^2 + s2^2)/(4 a)
 
     IntersectionDistance[s1_, s2_, a_, d_] := (2 a d - s1^2 + s2^2)/(4 a)
+
+  All of these are linear in the squared speeds. The planner therefore stores speeds squared and 
+  each block keeps 2 a d for its full length (block_plan_t.max_delta_speed_sqr). The lookahead then 
+  needs no square roots at all, and the distances become fractions of the block:
+
+    d -> (m^2 - s^2)/(2 a d) of the block --> steps_for_speed_sqr()
+    di -> (2 a d - s1^2 + s2^2)/(2 (2 a d)) of the block
 */
                                                                                                             
-
 #include <inttypes.h>
 #include <math.h>       
 #include <stdlib.h>
@@ -62,88 +68,231 @@
 #include "settings.h"
 #include "config.h"
 #include "wiring_serial.h"
+#include "serial_protocol.h"
 
-// The number of linear motions that can be in the plan at any give time
-// MM_COMMENT - must be a power of 2 less than 128
-#ifdef __AVR_ATmega328P__
-#define BLOCK_BUFFER_SIZE 16
-#else
-#define BLOCK_BUFFER_SIZE 4
-#endif
+// The most step events a block can hold. Longer lines are split.
+#define MAX_STEP_EVENTS 0xffff
+
+// The value of 1.0 in the Q15 unit vectors
+#define UNIT_VECTOR_ONE 32767.0
+
+// The stepper counts the wait of a command block in step events of one millisecond
+#define COMMAND_EVENTS_PER_MINUTE 60000
 
 static block_t block_buffer[BLOCK_BUFFER_SIZE];  // A ring buffer for motion instructions
+static block_plan_t block_plan[BLOCK_BUFFER_SIZE]; // The planner's part of each block in block_buffer
 static volatile uint8_t block_buffer_head;           // Index of the next block to be pushed
 static volatile uint8_t block_buffer_tail;           // Index of the block to process now
+static volatile uint8_t block_buffer_planned;        // Index of the last optimally planned block. It and all 
+                                                     // blocks before it are skipped by planner_recalculate()
+static uint8_t block_buffer_prep;                    // Index of the next block to hand to the stepper segment buffer
+
+// The stepper traces an arc as a series of chords, cut from it by plan_get_next_prep_block() as the segment 
+// buffer takes them
+static block_t chord_buffer[CHORD_BUFFER_SIZE];     // A ring buffer of the chords handed to the stepper
+static volatile uint8_t chord_buffer_head;           // Index of the next chord to be pushed
+static volatile uint8_t chord_buffer_tail;           // Index of the chord being traced
+static block_t *prep_arc;                            // The arc being cut into chords, NULL if none
+static uint16_t arc_chord;                           // The number of the chord ending at arc_chord_end
+static uint16_t arc_chord_start;                     // The number of the chord the next chord handed out starts after
+static int32_t arc_chord_end[3];                     // The end of the next chord in steps
+static double arc_vec[2];                            // The vector from the center to the end of chord arc_chord
+static double arc_cos, arc_sin;                      // The rotation by theta_per_chord
+static double arc_theta, arc_radius;                 // The start angle and the radius
+static double arc_linear_start;                      // The start on the third axis in steps
+static uint8_t arc_correction_count;                 // The chords since the vector was last computed exactly
+static double arc_acceleration;                      // mm/sec^2
+static speed_sqr_t arc_exit_speed_sqr;               // The planned speed at the end of the arc squared
 
 // The current position of the tool in absolute steps
 static int32_t position[3];   
+// The position at the end of the blocks handed to the stepper segment buffer, where the next arc starts
+static int32_t prep_position[3];
 
 static uint8_t acceleration_manager_enabled;   // Acceleration management active?
 
-#define ONE_MINUTE_OF_MICROSECONDS 60000000.0
+// Values derived from the settings by plan_load_settings() so plan_buffer_line() need not divide
+static double mm_per_step[3];                  // The reciprocal of settings.steps_per_mm
+static double max_jerk_sqr;                    // settings.max_jerk squared
+static speed_sqr_t safe_speed_sqr;             // The safe speed max_jerk/2, squared. The plan always ends at this
+                                               // speed and no junction is limited below it
+
+// The last buffered block's velocity, for the junction with the next one
+static int16_t previous_unit_vec[3];           // Direction of travel as a Q15 unit vector
+static double previous_nominal_speed;          // mm/min
+
+// Returns the index of the block after block_index in the ring buffer
+static uint8_t next_block_index(uint8_t block_index) {
+  block_index++;
+  if (block_index == BLOCK_BUFFER_SIZE) { block_index = 0; }
+  return(block_index);
+}
+
+// Returns the index of the block before block_index in the ring buffer
+static uint8_t prev_block_index(uint8_t block_index) {
+  if (block_index == 0) { block_index = BLOCK_BUFFER_SIZE; }
+  return(block_index-1);
+}
+
+// Returns the index of the chord after chord_index in the chord ring buffer
+static uint8_t next_chord_index(uint8_t chord_index) {
+  chord_index++;
+  if (chord_index == CHORD_BUFFER_SIZE) { chord_index = 0; }
+  return(chord_index);
+}
+
+#ifdef PLANNER_FIXED_POINT
+
+// Speeds squared are kept with this many fractional bits
+#define SPEED_SQR_FRACTION_BITS 4
+// The largest speed squared the planner handles (about 11500 mm/min). Leaves headroom so sums of two never 
+// overflow.
+#define MAX_SPEED_SQR 0x7fffffffUL
+
+// Returns x/d as a 0.32 fixed point fraction, x must be less than d. Plain restoring division.
+static uint32_t q32_fraction(uint32_t x, uint32_t d) {
+  uint32_t quotient = 0;
+  uint8_t i;
+  for (i = 0; i < 32; i++) {
+    uint8_t carry = x >> 31;
+    x <<= 1;
+    quotient <<= 1;
+    if (carry || x >= d) {
+      x -= d;
+      quotient |= 1;
+    }
+  }
+  return(quotient);
+}
+
+// Returns the integer square root of x, rounded down
+static uint16_t isqrt32(uint32_t x) {
+  uint32_t root = 0;
+  uint32_t bit = 1UL << 30;
+  while (bit > x) { bit >>= 2; }
+  while (bit) {
+    if (x >= root + bit) {
+      x -= root + bit;
+      root = (root >> 1) + bit;
+    } else {
+      root >>= 1;
+    }
+    bit >>= 2;
+  }
+  return(root);
+}
+
+// Returns n*q/2^32, i.e. n scaled by the 0.32 fraction q, rounded down or up. Only uses 16x16 bit 
+// multiplications.
+static uint32_t mul_q32(uint32_t n, uint32_t q, uint8_t round_up) {
+  uint16_t n_lo = n, n_hi = n >> 16, q_lo = q, q_hi = q >> 16;
+  uint32_t lo = (uint32_t)n_lo*q_lo;
+  uint32_t mid_a = (uint32_t)n_hi*q_lo;
+  uint32_t mid_b = (uint32_t)n_lo*q_hi;
+  uint32_t mid = (lo >> 16) + (mid_a & 0xffff) + (mid_b & 0xffff);
+  uint32_t result = (uint32_t)n_hi*q_hi + (mid_a >> 16) + (mid_b >> 16) + (mid >> 16);
+  if (round_up && ((mid & 0xffff) || (lo & 0xffff))) { result++; }
+  return(result);
+}
+
+#endif
 
-// Calculates the distance (not time) it takes to accelerate from initial_rate to target_rate using the 
-// given acceleration:
-inline double estimate_acceleration_distance(double initial_rate, double target_rate, double acceleration) {
-  return(
-    (target_rate*target_rate-initial_rate*initial_rate)/
-    (2L*acceleration)
-  );
+// Converts a speed squared in (mm/min)^2 to the planner representation
+static speed_sqr_t to_speed_sqr(double speed_sqr) {
+#ifdef PLANNER_FIXED_POINT
+  speed_sqr *= (1 << SPEED_SQR_FRACTION_BITS);
+  if (speed_sqr >= MAX_SPEED_SQR) { return(MAX_SPEED_SQR); }
+  if (speed_sqr <= 0) { return(0); }
+  return(speed_sqr);
+#else
+  return(speed_sqr);
+#endif
 }
 
-// This function gives you the point at which you must start braking (at the rate of -acceleration) if 
-// you started at speed initial_rate and accelerated until this point and want to end at the final_rate after
-// a total travel of distance. This can be used to compute the intersection point between acceleration and
-// deceleration in the cases where the trapezoid has no plateau (i.e. never reaches maximum speed)
+// Converts a speed squared in the planner representation to the speed in mm/min
+static double speed_for_speed_sqr(speed_sqr_t speed_sqr) {
+#ifdef PLANNER_FIXED_POINT
+  return(sqrt(speed_sqr)/(1 << (SPEED_SQR_FRACTION_BITS/2)));
+#else
+  return(sqrt(speed_sqr));
+#endif
+}
 
-/*                        + <- some maximum rate we don't care about
-                         /|\
-                        / | \                    
-                       /  |  + <- final_rate     
-                      /   |  |                   
-     initial_rate -> +----+--+                   
-                          ^  ^                   
-                          |  |                   
-      intersection_distance  distance                                                                           */
+// Returns the share numerator/denominator of a speed squared. The numerator must not exceed the denominator.
+static speed_sqr_t share_of_speed_sqr(speed_sqr_t speed_sqr, uint16_t numerator, uint16_t denominator) {
+#ifdef PLANNER_FIXED_POINT
+  if (numerator >= denominator) { return(speed_sqr); }
+  return(mul_q32(speed_sqr, q32_fraction(numerator, denominator), FALSE));
+#else
+  return(speed_sqr*numerator/denominator);
+#endif
+}
 
-inline double intersection_distance(double initial_rate, double final_rate, double acceleration, double distance) {
-  return(
-    (2*acceleration*distance-initial_rate*initial_rate+final_rate*final_rate)/
-    (4*acceleration)
-  );
+// Returns the number of step events it takes to change the speed squared by delta_speed_sqr where range_sqr
+// is the change in speed squared the acceleration allows over the full block. delta_speed_sqr must not 
+// exceed range_sqr.
+static int32_t steps_for_speed_sqr(block_t *block, speed_sqr_t delta_speed_sqr, speed_sqr_t range_sqr, 
+  uint8_t round_up) {
+#ifdef PLANNER_FIXED_POINT
+  if (delta_speed_sqr >= range_sqr) { return(block->step_event_count); }
+  return(mul_q32(block->step_event_count, q32_fraction(delta_speed_sqr, range_sqr), round_up));
+#else
+  double steps = (block->step_event_count*delta_speed_sqr)/range_sqr;
+  if (round_up) { return(ceil(steps)); }
+  return(floor(steps));
+#endif
 }
 
+// Returns the step rate of the block when moving at the given speed squared, rounded up
+static uint32_t rate_for_speed_sqr(block_t *block, block_plan_t *plan, speed_sqr_t speed_sqr) {
+  if (speed_sqr >= plan->nominal_speed_sqr) { return(block->nominal_rate); }
+#ifdef PLANNER_FIXED_POINT
+  // The speed relative to nominal_speed as a 0.16 fraction, refined to 0.32 with one newton step
+  uint32_t fraction = q32_fraction(speed_sqr, plan->nominal_speed_sqr);
+  uint16_t root = isqrt32(fraction);
+  if (root == 0) { return(0); }
+  uint32_t factor = ((uint32_t)root << 16) + (((fraction-(uint32_t)root*root) << 15)/root);
+  return(mul_q32(block->nominal_rate, factor, TRUE));
+#else
+  return(ceil(block->nominal_rate*sqrt(speed_sqr/plan->nominal_speed_sqr)));
+#endif
+}
 
-// Calculates trapezoid parameters so that the entry- and exit-speed is compensated by the provided factors.
-// The factors represent a factor of braking and must be in the range 0.0-1.0.
+// Calculates trapezoid parameters so that the block is entered and exited at the given junction speeds 
+// squared. They must be reachable from each other within the block. Junction speeds above the nominal 
+// speed are clipped to it.
 
 /*                                                                              
                                      +--------+   <- nominal_rate
                                     /          \                                
-    nominal_rate*entry_factor ->   +            \                               
-                                   |             + <- nominal_rate*exit_factor  
+    rate at entry_speed_sqr ->     +            \                               
+                                   |             + <- rate at exit_speed_sqr  
                                    +-------------+                              
                                        time -->                                 
 */                                                                              
 
-void calculate_trapezoid_for_block(block_t *block, double entry_factor, double exit_factor) {
-  block->initial_rate = ceil(block->nominal_rate*entry_factor);
-  block->final_rate = ceil(block->nominal_rate*exit_factor);
-  int32_t acceleration_per_minute = block->rate_delta*ACCELERATION_TICKS_PER_SECOND*60.0;
-  int32_t accelerate_steps = 
-    ceil(estimate_acceleration_distance(block->initial_rate, block->nominal_rate, acceleration_per_minute));
-  int32_t decelerate_steps = 
-    floor(estimate_acceleration_distance(block->nominal_rate, block->final_rate, -acceleration_per_minute));
+void calculate_trapezoid_for_block(block_t *block, block_plan_t *plan, speed_sqr_t entry_speed_sqr, 
+  speed_sqr_t exit_speed_sqr) {
+  // A block slower than the safe speed runs at its nominal speed throughout. Jumping to or from it at a 
+  // junction changes the speed by less than max_jerk/2.
+  if (entry_speed_sqr > plan->nominal_speed_sqr) { entry_speed_sqr = plan->nominal_speed_sqr; }
+  if (exit_speed_sqr > plan->nominal_speed_sqr) { exit_speed_sqr = plan->nominal_speed_sqr; }
+  block->initial_rate = rate_for_speed_sqr(block, plan, entry_speed_sqr);
+  block->final_rate = rate_for_speed_sqr(block, plan, exit_speed_sqr);
+  int32_t accelerate_steps = steps_for_speed_sqr(block, plan->nominal_speed_sqr-entry_speed_sqr, 
+    plan->max_delta_speed_sqr, TRUE);
+  int32_t decelerate_steps = steps_for_speed_sqr(block, plan->nominal_speed_sqr-exit_speed_sqr, 
+    plan->max_delta_speed_sqr, FALSE);
 
   // Calculate the size of Plateau of Nominal Rate. 
   int32_t plateau_steps = block->step_event_count-accelerate_steps-decelerate_steps;
   
   // Is the Plateau of Nominal Rate smaller than nothing? That means no cruising, and we will
-  // have to use intersection_distance() to calculate when to abort acceleration and start braking 
+  // have to use the intersection distance to calculate when to abort acceleration and start braking 
   // in order to reach the final_rate exactly at the end of this block.
   if (plateau_steps < 0) {  
-    accelerate_steps = ceil(
-      intersection_distance(block->initial_rate, block->final_rate, acceleration_per_minute, block->step_event_count));
+    accelerate_steps = steps_for_speed_sqr(block, plan->max_delta_speed_sqr+exit_speed_sqr-entry_speed_sqr,
+      2*plan->max_delta_speed_sqr, TRUE);
     plateau_steps = 0;
   }  
   
@@ -151,175 +300,231 @@ void calculate_trapezoid_for_block(block_t *block, double entry_factor, double e
   block->decelerate_after = accelerate_steps+plateau_steps;
 }                    
 
-// Calculates the maximum allowable speed at this point when you must be able to reach target_velocity using the 
-// acceleration within the allotted distance.
-inline double max_allowable_speed(double acceleration, double target_velocity, double distance) {
-  return(
-    sqrt(target_velocity*target_velocity-2*acceleration*60*60*distance)
-  );
+// "Junction jerk" in this context is the immediate change in speed at the junction of two blocks.
+// This method will calculate the square of the junction jerk as the squared euclidean distance between 
+// the nominal velocity of the block before, moving along previous_vec, and the given one.
+double junction_jerk_sqr(int16_t *previous_vec, double previous_speed, int16_t *unit_vec, double nominal_speed) {
+  double jerk_sqr = 0;
+  uint8_t axis;
+  for (axis = X_AXIS; axis <= Z_AXIS; axis++) {
+    jerk_sqr += square(previous_speed*previous_vec[axis]-nominal_speed*unit_vec[axis]);
+  }
+  return(jerk_sqr/square(UNIT_VECTOR_ONE));
 }
 
-// "Junction jerk" in this context is the immediate change in speed at the junction of two blocks.
-// This method will calculate the junction jerk as the euclidean distance between the nominal 
-// velocities of the respective blocks.
-inline double junction_jerk(block_t *before, block_t *after) {
-  return(sqrt(
-    pow(before->speed_x-after->speed_x, 2)+
-    pow(before->speed_y-after->speed_y, 2)+
-    pow(before->speed_z-after->speed_z, 2))
-  );
-}
-
-// Calculate a braking factor to reach baseline speed which is max_jerk/2, e.g. the 
-// speed under which you cannot exceed max_jerk no matter what you do.
-double factor_for_safe_speed(block_t *block) {
-  return(settings.max_jerk/block->nominal_speed);  
-}
-
-// The kernel called by planner_recalculate() when scanning the plan from last to first entry.
-void planner_reverse_pass_kernel(block_t *previous, block_t *current, block_t *next) {
-  if(!current) { return; }
-
-  double entry_factor = 1.0;
-  double exit_factor;
-  if (next) {
-    exit_factor = next->entry_factor;
-  } else {
-    exit_factor = factor_for_safe_speed(current);
+// Returns the largest speed squared for the junction between a block moving along previous_vec and a block 
+// moving along unit_vec when the corner is rounded off by a circle that passes within 
+// settings.junction_deviation of it and the centripetal acceleration v^2/r stays within the acceleration
+// of the new block. The circle touching both lines at that deviation has the radius
+//
+//   r = junction_deviation*sin(theta/2)/(1-sin(theta/2))
+//
+// where theta is the angle between the lines. Nothing stops at a straight junction and a full reversal 
+// must stop.
+speed_sqr_t junction_deviation_speed_sqr(int16_t *previous_vec, int16_t *unit_vec, double acceleration, 
+  speed_sqr_t vmax_junction_sqr) {
+  // The cosine of the angle between the lines, -1 when the path continues straight on
+  int32_t dot_product = 0;
+  uint8_t axis;
+  for (axis = X_AXIS; axis <= Z_AXIS; axis++) {
+    dot_product += (int32_t)previous_vec[axis]*unit_vec[axis];
   }
-  
-  // Calculate the entry_factor for the current block. 
-  if (previous) {
-    // Reduce speed so that junction_jerk is within the maximum allowed
-    double jerk = junction_jerk(previous, current);
-    if (jerk > settings.max_jerk) {
-      entry_factor = (settings.max_jerk/jerk);
-    } 
-    // If the required deceleration across the block is too rapid, reduce the entry_factor accordingly.
-    if (entry_factor > exit_factor) {
-      double max_entry_speed = max_allowable_speed(-settings.acceleration,current->nominal_speed*exit_factor, 
-        current->millimeters);
-      double max_entry_factor = max_entry_speed/current->nominal_speed;
-      if (max_entry_factor < entry_factor) {
-        entry_factor = max_entry_factor;
-      }
-    }    
-  } else {
-    entry_factor = factor_for_safe_speed(current);
+  double cos_theta = -dot_product/square(UNIT_VECTOR_ONE);
+  if (cos_theta < -0.999) { return(vmax_junction_sqr); }
+  if (cos_theta > 0.999) { return(0); }
+  double sin_theta_d2 = sqrt(0.5*(1.0-cos_theta));
+  speed_sqr_t speed_sqr = to_speed_sqr(
+    acceleration*60*60*settings.junction_deviation*sin_theta_d2/(1.0-sin_theta_d2));
+  return(min(speed_sqr, vmax_junction_sqr));
+}
+
+// Returns the largest speed squared, up to vmax_junction_sqr, for the junction from a block moving along 
+// previous_vec at previous_speed to one moving along unit_vec at nominal_speed with the given acceleration. 
+// Limited by the junction deviation or, if that is set to 0, so that the junction jerk is within the maximum 
+// allowed.
+static speed_sqr_t junction_speed_sqr(int16_t *previous_vec, double previous_speed, int16_t *unit_vec, 
+  double nominal_speed, double acceleration, speed_sqr_t vmax_junction_sqr) {
+  if (settings.junction_deviation > 0) {
+    return(junction_deviation_speed_sqr(previous_vec, unit_vec, acceleration, vmax_junction_sqr));
   }
-    
-  // Store result
-  current->entry_factor = entry_factor;
+  double jerk_sqr = junction_jerk_sqr(previous_vec, previous_speed, unit_vec, nominal_speed);
+  if (jerk_sqr > max_jerk_sqr) {
+    vmax_junction_sqr *= (max_jerk_sqr/jerk_sqr);
+  }
+  return(vmax_junction_sqr);
 }
 
-// planner_recalculate() needs to go over the current plan twice. Once in reverse and once forward. This 
-// implements the reverse pass.
-void planner_reverse_pass() {
-  auto uint8_t block_index = block_buffer_head;
-  block_t *block[3] = {NULL, NULL, NULL};
-  while(block_index != block_buffer_tail) {
-    if(block_index == 0) {
-      block_index = BLOCK_BUFFER_SIZE-1;
+// The kernel called by planner_recalculate() when scanning the plan from last to first entry. Entry 
+// speeds only ever grow as blocks are appended, so a block already at its max_entry_speed is left alone.
+// Returns TRUE if the entry_speed of current changed.
+int planner_reverse_pass_kernel(block_plan_t *current, block_plan_t *next) {
+  if (current->entry_speed_sqr != current->max_entry_speed_sqr) {
+    speed_sqr_t exit_speed_sqr;
+    if (next) {
+      exit_speed_sqr = next->entry_speed_sqr;
     } else {
-	  block_index--;
-	}
-    block[2]= block[1];
-    block[1]= block[0];
-    block[0] = &block_buffer[block_index];
-    planner_reverse_pass_kernel(block[0], block[1], block[2]);
+      exit_speed_sqr = safe_speed_sqr;
+    }
+    speed_sqr_t entry_speed_sqr = current->max_entry_speed_sqr;
+    // If the required deceleration across the block is too rapid, reduce the entry_speed accordingly.
+    if (entry_speed_sqr > exit_speed_sqr+current->max_delta_speed_sqr) {
+      entry_speed_sqr = exit_speed_sqr+current->max_delta_speed_sqr;
+    }
+    if (entry_speed_sqr != current->entry_speed_sqr) {
+      current->entry_speed_sqr = entry_speed_sqr;
+      current->recalculate_flag = TRUE;
+      return(TRUE);
+    }
   }
-  planner_reverse_pass_kernel(NULL, block[0], block[1]);
-}
-
-// The kernel called by planner_recalculate() when scanning the plan from first to last entry.
-void planner_forward_pass_kernel(block_t *previous, block_t *current, block_t *next) {
-  if(!current) { return; }
-  if(previous) {
-    // If the previous block is an acceleration block, but it is not long enough to 
-    // complete the full speed change within the block, we need to adjust out entry
-    // speed accordingly. Remember current->entry_factor equals the exit factor of 
-    // the previous block.
-    if(previous->entry_factor < current->entry_factor) {
-      double max_entry_speed = max_allowable_speed(-settings.acceleration,
-        current->nominal_speed*previous->entry_factor, previous->millimeters);
-      double max_entry_factor = max_entry_speed/current->nominal_speed;
-      if (max_entry_factor < current->entry_factor) {
-        current->entry_factor = max_entry_factor;
-      }
+  return(FALSE);
+}
+
+// planner_recalculate() needs to go over the current plan twice. Once in reverse and once forward. This 
+// implements the reverse pass. It stops at block_buffer_planned as nothing up to that block can change, or
+// as soon as a junction speed comes out unchanged as then none of the junctions before it will change 
+// either. Returns the index of the block the pass stopped at.
+uint8_t planner_reverse_pass() {
+  uint8_t block_index = block_buffer_head;
+  block_plan_t *current = NULL;
+  block_plan_t *next;
+  for(;;) {
+    block_index = prev_block_index(block_index);
+    if(block_index == block_buffer_planned) { break; }
+    next = current;
+    current = &block_plan[block_index];
+    // The newest block was prepared by plan_buffer_line(). Its predecessor must always be revisited.
+    if (!planner_reverse_pass_kernel(current, next) && next) { break; }
+  }
+  return(block_index);
+}
+
+// The kernel called by planner_recalculate() when scanning the plan from first to last entry. Returns 
+// TRUE if the entry_speed of current can never change again: it is either at max_entry_speed or limited 
+// by accelerating across an optimally planned previous block.
+int planner_forward_pass_kernel(block_plan_t *previous, block_plan_t *current) {
+  // If the previous block is an acceleration block, but it is not long enough to 
+  // complete the full speed change within the block, we need to adjust out entry
+  // speed accordingly. Remember current->entry_speed equals the exit speed of 
+  // the previous block.
+  if(previous->entry_speed_sqr < current->entry_speed_sqr) {
+    speed_sqr_t max_entry_speed_sqr = previous->entry_speed_sqr+previous->max_delta_speed_sqr;
+    if (max_entry_speed_sqr < current->entry_speed_sqr) {
+      current->entry_speed_sqr = max_entry_speed_sqr;
+      current->recalculate_flag = TRUE;
+      return(TRUE);
     }
   }
+  return(current->entry_speed_sqr == current->max_entry_speed_sqr);
 }
 
 // planner_recalculate() needs to go over the current plan twice. Once in reverse and once forward. This 
-// implements the forward pass.
-void planner_forward_pass() {
-  uint8_t block_index = block_buffer_tail;
-  block_t *block[3] = {NULL, NULL, NULL};
+// implements the forward pass starting at the block the reverse pass stopped at. Every block found to be 
+// optimal moves block_buffer_planned up to it.
+void planner_forward_pass(uint8_t block_index) {
+  block_plan_t *previous;
+  block_plan_t *current = &block_plan[block_index];
   
+  block_index = next_block_index(block_index);
   while(block_index != block_buffer_head) {
-    block[0] = block[1];
-    block[1] = block[2];
-    block[2] = &block_buffer[block_index];
-    planner_forward_pass_kernel(block[0],block[1],block[2]);
-	block_index = (block_index+1);
-	block_index = block_index % BLOCK_BUFFER_SIZE;
+    previous = current;
+    current = &block_plan[block_index];
+    if (planner_forward_pass_kernel(previous, current)) {
+      block_buffer_planned = block_index;
+    }
+    block_index = next_block_index(block_index);
   }
-  planner_forward_pass_kernel(block[1], block[2], NULL);
 }
 
-// Recalculates the trapezoid speed profiles for all blocks in the plan according to the 
-// entry_factor for each junction. Must be called by planner_recalculate() after 
-// updating the blocks.
-void planner_recalculate_trapezoids() {
-  uint8_t block_index = block_buffer_tail;
-  block_t *current;
-  block_t *next = NULL;
+// Recalculates the trapezoid speed profiles for the blocks from block_index onwards whose entry- or exit 
+// speed changed. Must be called by planner_recalculate() after updating the blocks.
+void planner_recalculate_trapezoids(uint8_t block_index) {
+  uint8_t current_index;
+  block_plan_t *current;
+  block_plan_t *next = NULL;
   
   while(block_index != block_buffer_head) {
     current = next;
-    next = &block_buffer[block_index];
+    next = &block_plan[block_index];
     if (current) {
-      calculate_trapezoid_for_block(current, current->entry_factor, next->entry_factor);      
+      if (current->recalculate_flag || next->recalculate_flag) {
+        // An arc gets the trapezoids of its chords as they are cut from it
+        if (block_buffer[current_index].type == BLOCK_LINE) {
+          calculate_trapezoid_for_block(&block_buffer[current_index], current, current->entry_speed_sqr, 
+            next->entry_speed_sqr);
+        }
+        current->recalculate_flag = FALSE;
+      }
     }
-	  block_index = (block_index+1);
-	  block_index = block_index % BLOCK_BUFFER_SIZE;
+    current_index = block_index;
+    block_index = next_block_index(block_index);
   }
-  calculate_trapezoid_for_block(next, next->entry_factor, factor_for_safe_speed(next));
+  // The last block in the plan always exits at the safe speed
+  if (block_buffer[current_index].type == BLOCK_LINE) {
+    calculate_trapezoid_for_block(&block_buffer[current_index], next, next->entry_speed_sqr, safe_speed_sqr);
+  }
+  next->recalculate_flag = FALSE;
 }
 
 // Recalculates the motion plan according to the following algorithm:
 //
-//   1. Go over every block in reverse order and calculate a junction speed reduction (i.e. block_t.entry_factor) 
+//   1. Go over every unplanned block in reverse order and calculate a junction speed (i.e. block_plan_t.entry_speed_sqr) 
 //      so that:
-//     a. The junction jerk is within the set limit
+//     a. The junction speed is within the cornering limit (i.e. block_plan_t.max_entry_speed_sqr)
 //     b. No speed reduction within one block requires faster deceleration than the one, true constant 
 //        acceleration.
-//   2. Go over every block in chronological order and dial down junction speed reduction values if 
+//   2. Go over every unplanned block in chronological order and dial down junction speeds if 
 //     a. The speed increase within one block would require faster accelleration than the one, true 
 //        constant acceleration.
 //
-// When these stages are complete all blocks have an entry_factor that will allow all speed changes to 
-// be performed using only the one, true constant acceleration, and where no junction jerk is jerkier than 
-// the set limit. Finally it will:
+// When these stages are complete all blocks have an entry_speed that will allow all speed changes to 
+// be performed using only the one, true constant acceleration, and where no junction is faster than
+// its cornering limit. Finally it will:
+//
+//   3. Recalculate trapezoids for the blocks whose entry- or exit speed changed.
 //
-//   3. Recalculate trapezoids for all blocks.
+// The plan always ends at the safe speed and no junction is ever limited below it, so appending a block 
+// can only raise the entry speeds of the blocks before it. A block whose entry_speed is at max_entry_speed, 
+// or is limited by accelerating out of an optimally planned block, is therefore final. Every such block moves 
+// block_buffer_planned forward and no pass goes behind it. The reverse pass also stops at the first junction 
+// that does not change, and only the blocks touched after that point get new trapezoids. Once the stepper 
+// has started preparing a block, plan_get_next_prep_block() locks its exit speed as well by moving 
+// block_buffer_planned past it.
 
 void planner_recalculate() {     
-  planner_reverse_pass();
-  planner_forward_pass();
-  planner_recalculate_trapezoids();
+  // Blocks before the one the reverse pass stopped at are unchanged, and so are their trapezoids
+  uint8_t block_index = planner_reverse_pass();
+  planner_forward_pass(block_index);
+  planner_recalculate_trapezoids(block_index);
 }
 
 void plan_init() {
   block_buffer_head = 0;
   block_buffer_tail = 0;
+  block_buffer_planned = 0;
+  block_buffer_prep = 0;
+  chord_buffer_head = 0;
+  chord_buffer_tail = 0;
+  prep_arc = NULL;
   plan_set_acceleration_manager_enabled(TRUE);
   clear_vector(position);
+  clear_vector(prep_position);
+  plan_load_settings();
 }
 
+void plan_load_settings() {
+  mm_per_step[X_AXIS] = 1.0/settings.steps_per_mm[X_AXIS];
+  mm_per_step[Y_AXIS] = 1.0/settings.steps_per_mm[Y_AXIS];
+  mm_per_step[Z_AXIS] = 1.0/settings.steps_per_mm[Z_AXIS];
+  max_jerk_sqr = square(settings.max_jerk);
+  safe_speed_sqr = to_speed_sqr(max_jerk_sqr/4);
+}
+
+// Takes effect with the next buffered block, without waiting for the buffer to drain. The blocks already
+// buffered keep their profiles: moving block_buffer_planned to the head keeps the lookahead from replanning
+// across the change, and the first block after it starts at the safe speed.
 void plan_set_acceleration_manager_enabled(int enabled) {
   if ((!!acceleration_manager_enabled) != (!!enabled)) {
-    st_synchronize();
+    block_buffer_planned = block_buffer_head;
     acceleration_manager_enabled = !!enabled;
   }
 }
@@ -336,12 +541,19 @@ void plan_redefine_current_position(double x, double y, double z)
 	target[Y_AXIS] = lround(y*settings.steps_per_mm[Y_AXIS]);
 	target[Z_AXIS] = lround(z*settings.steps_per_mm[Z_AXIS]);  
 	memcpy(position, target, sizeof(target)); // position[] = target[]
+	memcpy(prep_position, target, sizeof(target));
+	st_set_position(target);
 }
 
 inline void plan_discard_current_block() {
   if (block_buffer_head != block_buffer_tail) {
-	  block_buffer_tail = (block_buffer_tail + 1);
-	  block_buffer_tail = block_buffer_tail % BLOCK_BUFFER_SIZE;  
+    // An arc is done with its last chord
+    if (block_buffer[block_buffer_tail].type == BLOCK_ARC) {
+      uint8_t last_chord = (chord_buffer[chord_buffer_tail].type == BLOCK_LAST_CHORD);
+      chord_buffer_tail = next_chord_index(chord_buffer_tail);
+      if (!last_chord) { return; }
+    }
+	  block_buffer_tail = next_block_index(block_buffer_tail);
   }
 }
 
@@ -350,6 +562,298 @@ inline block_t *plan_get_current_block() {
   return(&block_buffer[block_buffer_tail]);
 }
 
+double plan_get_current_speed(uint32_t steps_per_minute) {
+  uint8_t tail = block_buffer_tail;
+  if (block_buffer_head == tail) { return(0); }
+  block_t *block = &block_buffer[tail];
+  // An arc moves at the rate of the chord being traced
+  if (block->type == BLOCK_ARC) {
+    if (chord_buffer_head == chord_buffer_tail) { return(0); }
+    block = &chord_buffer[chord_buffer_tail];
+  }
+  return(speed_for_speed_sqr(block_plan[tail].nominal_speed_sqr)*steps_per_minute/block->nominal_rate);
+}
+
+uint8_t plan_get_free_block_count() {
+  uint8_t tail = block_buffer_tail;
+  uint8_t used = (block_buffer_head >= tail) ? block_buffer_head-tail : BLOCK_BUFFER_SIZE+block_buffer_head-tail;
+  return(BLOCK_BUFFER_SIZE-1-used);
+}
+
+// Sets vec to the vector in mm from the center of the arc to the position start in steps, and theta and 
+// radius to its angle and length
+static void arc_start(arc_t *arc, int32_t *start, double *vec, double *theta, double *radius) {
+  vec[0] = start[arc->axis_1]*mm_per_step[arc->axis_1]-arc->center[0];
+  vec[1] = start[arc->axis_2]*mm_per_step[arc->axis_2]-arc->center[1];
+  *theta = atan2(vec[0], vec[1]);
+  *radius = hypot(vec[0], vec[1]);
+}
+
+// Returns the length in mm of each chord of the arc. Sets share to the largest part of a chord along each 
+// axis, relative to its length.
+static double arc_chord_shares(arc_t *arc, double radius, double *share) {
+  uint8_t axis_linear = X_AXIS+Y_AXIS+Z_AXIS-arc->axis_1-arc->axis_2;
+  double planar_mm = fabs(2*radius*sin(arc->theta_per_chord/2));
+  double linear_mm = fabs(arc->steps_per_chord*mm_per_step[axis_linear]);
+  double chord_mm = hypot(planar_mm, linear_mm);
+  share[arc->axis_1] = planar_mm/chord_mm;
+  share[arc->axis_2] = planar_mm/chord_mm;
+  share[axis_linear] = linear_mm/chord_mm;
+  return(chord_mm);
+}
+
+// Sets unit_vec to the direction of the chord with the given number, counting from 1, of the arc starting 
+// at the angle theta
+static void arc_chord_vector(arc_t *arc, double theta, double radius, uint16_t chord, int16_t *unit_vec) {
+  uint8_t axis_linear = X_AXIS+Y_AXIS+Z_AXIS-arc->axis_1-arc->axis_2;
+  double planar_mm = 2*radius*sin(arc->theta_per_chord/2);
+  double linear_mm = arc->steps_per_chord*mm_per_step[axis_linear];
+  double inverse_chord_mm = UNIT_VECTOR_ONE/hypot(planar_mm, linear_mm);
+  // The chord runs at right angles to the vector to its middle
+  double middle = theta+(chord-0.5)*arc->theta_per_chord;
+  unit_vec[arc->axis_1] = lround(planar_mm*cos(middle)*inverse_chord_mm);
+  unit_vec[arc->axis_2] = lround(-planar_mm*sin(middle)*inverse_chord_mm);
+  unit_vec[axis_linear] = lround(linear_mm*inverse_chord_mm);
+}
+
+// Clamps the speed in mm/min and the acceleration in mm/sec^2 of a move to the most restrictive axis, where 
+// share is the part of the move along each axis, relative to its length. Only divides when an axis limits.
+static void plan_limit_to_axes(double *share, double *nominal_speed, double *acceleration) {
+  uint8_t axis;
+  for (axis = X_AXIS; axis <= Z_AXIS; axis++) {
+    double unit = fabs(share[axis]);
+    if (settings.max_rate[axis] < *nominal_speed*unit) { *nominal_speed = settings.max_rate[axis]/unit; }
+    if (settings.max_acceleration[axis] < *acceleration*unit) { *acceleration = settings.max_acceleration[axis]/unit; }
+  }
+}
+
+// Sets the step counts and direction bits of a line block from the position from to the position to in 
+// steps. Sets delta_mm to the travel along each axis and returns the length in mm.
+static double plan_set_line_steps(block_t *block, int32_t *from, int32_t *to, double *delta_mm) {
+  block->type = BLOCK_LINE;
+  block->steps_x = labs(to[X_AXIS]-from[X_AXIS]);
+  block->steps_y = labs(to[Y_AXIS]-from[Y_AXIS]);
+  block->steps_z = labs(to[Z_AXIS]-from[Z_AXIS]);
+  block->step_event_count = max(block->steps_x, max(block->steps_y, block->steps_z));
+  
+  // Compute direction bits for this block
+  block->direction_bits = 0;
+  if (to[X_AXIS] < from[X_AXIS]) { block->direction_bits |= (1<<X_DIRECTION_BIT); }
+  if (to[Y_AXIS] < from[Y_AXIS]) { block->direction_bits |= (1<<Y_DIRECTION_BIT); }
+  if (to[Z_AXIS] < from[Z_AXIS]) { block->direction_bits |= (1<<Z_DIRECTION_BIT); }
+
+  delta_mm[X_AXIS] = (to[X_AXIS]-from[X_AXIS])*mm_per_step[X_AXIS];
+  delta_mm[Y_AXIS] = (to[Y_AXIS]-from[Y_AXIS])*mm_per_step[Y_AXIS];
+  delta_mm[Z_AXIS] = (to[Z_AXIS]-from[Z_AXIS])*mm_per_step[Z_AXIS];
+  return(sqrt(square(delta_mm[X_AXIS]) + square(delta_mm[Y_AXIS]) + square(delta_mm[Z_AXIS])));
+}
+
+// Sets the nominal step rate and the acceleration of a line block of the given length for the speed in 
+// mm/min and the acceleration in mm/sec^2
+static void plan_set_line_rates(block_t *block, double millimeters, double nominal_speed, double acceleration) {
+  double step_events_per_mm = block->step_event_count/millimeters;
+  block->nominal_rate = ceil(step_events_per_mm*nominal_speed);
+  // Compute the acceleration rate for the trapezoid generator. Depending on the slope of the line
+  // average travel per step event changes. For a line along one axis the travel per step event
+  // is equal to the travel/step in the particular axis. For a 45 degree line the steppers of both
+  // axes might step for every step event. Travel per step event is then sqrt(travel_x^2+travel_y^2).
+  // To generate trapezoids with contant acceleration between blocks the acceleration must be computed 
+  // specifically for each line to compensate for this phenomenon:
+  block->acceleration = ceil(
+    (acceleration*60.0*60.0)*                                       // acceleration mm/min/min
+    step_events_per_mm);                                            // convert to: acceleration steps/min/min
+}
+
+// Runs a line block at its nominal rate throughout, for when acceleration management is off
+static void plan_set_constant_rate(block_t *block) {
+  block->initial_rate = block->nominal_rate;
+  block->final_rate = block->nominal_rate;
+  block->accelerate_until = 0;
+  block->decelerate_after = block->step_event_count;
+  block->acceleration = 0;
+}
+
+// Moves arc_chord_end on to the end of the next chord of prep_arc that moves at least one step from 
+// prep_position, skipping chords too short to step. Returns FALSE if no chord is left.
+static uint8_t arc_next_chord_end() {
+  arc_t *arc = &prep_arc->arc;
+  uint8_t axis_linear = X_AXIS+Y_AXIS+Z_AXIS-arc->axis_1-arc->axis_2;
+  while (arc_chord < arc->chord_count) {
+    arc_chord++;
+    if (arc_chord == arc->chord_count) {
+      // The last chord ends exactly on the target
+      arc_chord_end[arc->axis_1] = arc->target[0];
+      arc_chord_end[arc->axis_2] = arc->target[1];
+    } else {
+      if (++arc_correction_count < N_ARC_CORRECTION) {
+        double r_new = arc_vec[0]*arc_cos + arc_vec[1]*arc_sin;
+        arc_vec[1] = arc_vec[1]*arc_cos - arc_vec[0]*arc_sin;
+        arc_vec[0] = r_new;
+      } else {
+        // Compute the vector exactly once in a while so the rounding errors of the rotations can't add up
+        double theta = arc_theta+arc_chord*arc->theta_per_chord;
+        arc_vec[0] = sin(theta)*arc_radius;
+        arc_vec[1] = cos(theta)*arc_radius;
+        arc_correction_count = 0;
+      }
+      arc_chord_end[arc->axis_1] = lround((arc->center[0]+arc_vec[0])*settings.steps_per_mm[arc->axis_1]);
+      arc_chord_end[arc->axis_2] = lround((arc->center[1]+arc_vec[1])*settings.steps_per_mm[arc->axis_2]);
+    }
+    arc_chord_end[axis_linear] = lround(arc_linear_start+arc_chord*arc->steps_per_chord);
+    if (arc_chord_end[X_AXIS] != prep_position[X_AXIS] || arc_chord_end[Y_AXIS] != prep_position[Y_AXIS] ||
+      arc_chord_end[Z_AXIS] != prep_position[Z_AXIS]) { return(TRUE); }
+  }
+  return(FALSE);
+}
+
+// Starts cutting the arc block into chords. The arc was planned as one block: its entry and exit speeds are
+// final now and the acceleration runs through the chords as if they were one line.
+static void arc_begin(block_t *block) {
+  arc_t *arc = &block->arc;
+  uint8_t axis_linear = X_AXIS+Y_AXIS+Z_AXIS-arc->axis_1-arc->axis_2;
+  uint8_t next_index = next_block_index(block - block_buffer);
+  // A block buffered while acceleration management is off has no entry speed. The arc stops as the last 
+  // block of a plan would.
+  arc_exit_speed_sqr = safe_speed_sqr;
+  if (next_index != block_buffer_head) {
+    block_t *next = &block_buffer[next_index];
+    if (next->type == BLOCK_ARC ? next->arc.accelerated : next->acceleration != 0) {
+      arc_exit_speed_sqr = block_plan[next_index].entry_speed_sqr;
+    }
+  }
+  prep_arc = block;
+  arc_start(arc, prep_position, arc_vec, &arc_theta, &arc_radius);
+  double share[3];
+  arc_chord_shares(arc, arc_radius, share);
+  double nominal_speed = 0;
+  arc_acceleration = settings.acceleration;
+  plan_limit_to_axes(share, &nominal_speed, &arc_acceleration);
+  arc_cos = cos(arc->theta_per_chord);
+  arc_sin = sin(arc->theta_per_chord);
+  arc_linear_start = prep_position[axis_linear];
+  arc_chord = 0;
+  arc_chord_start = 0;
+  arc_correction_count = 0;
+  arc_next_chord_end();
+}
+
+// Returns the planned speed squared of the arc being cut into chords at the end of the given chord. It 
+// accelerates from the entry speed and decelerates to the exit speed across the whole arc.
+static speed_sqr_t arc_speed_sqr(block_plan_t *plan, uint16_t chord) {
+  uint16_t chord_count = prep_arc->arc.chord_count;
+  speed_sqr_t speed_sqr = plan->nominal_speed_sqr;
+  speed_sqr_t reachable_sqr = plan->entry_speed_sqr+share_of_speed_sqr(plan->max_delta_speed_sqr, chord, 
+    chord_count);
+  if (reachable_sqr < speed_sqr) { speed_sqr = reachable_sqr; }
+  reachable_sqr = arc_exit_speed_sqr+share_of_speed_sqr(plan->max_delta_speed_sqr, chord_count-chord, 
+    chord_count);
+  if (reachable_sqr < speed_sqr) { speed_sqr = reachable_sqr; }
+  return(speed_sqr);
+}
+
+// Cuts the next chord from the arc being prepared into the chord buffer and returns it. Returns NULL if the 
+// chord buffer is full.
+static block_t *arc_next_chord() {
+  uint8_t next_head = next_chord_index(chord_buffer_head);
+  if (next_head == chord_buffer_tail) { return(NULL); }
+  block_t *chord = &chord_buffer[chord_buffer_head];
+  block_plan_t *plan = &block_plan[prep_arc - block_buffer];
+  uint8_t accelerated = prep_arc->arc.accelerated;
+  double delta_mm[3];
+  double millimeters = plan_set_line_steps(chord, prep_position, arc_chord_end, delta_mm);
+  memcpy(prep_position, arc_chord_end, sizeof(arc_chord_end)); // prep_position[] = arc_chord_end[]
+  plan_set_line_rates(chord, millimeters, speed_for_speed_sqr(plan->nominal_speed_sqr), arc_acceleration);
+  if (accelerated) {
+    // The chord's part of the arc's trapezoid. Skipped chords add their share.
+    block_plan_t chord_plan;
+    chord_plan.nominal_speed_sqr = plan->nominal_speed_sqr;
+    chord_plan.max_delta_speed_sqr = share_of_speed_sqr(plan->max_delta_speed_sqr, arc_chord-arc_chord_start, 
+      prep_arc->arc.chord_count);
+    if (chord_plan.max_delta_speed_sqr < 1) { chord_plan.max_delta_speed_sqr = 1; }
+    calculate_trapezoid_for_block(chord, &chord_plan, arc_speed_sqr(plan, arc_chord_start), 
+      arc_speed_sqr(plan, arc_chord));
+  } else {
+    plan_set_constant_rate(chord);
+  }
+  arc_chord_start = arc_chord;
+  if (!arc_next_chord_end()) {
+    chord->type = BLOCK_LAST_CHORD;
+    prep_arc = NULL;
+  }
+  chord_buffer_head = next_head;
+  return(chord);
+}
+
+block_t *plan_get_next_prep_block() {
+  if (prep_arc) { return(arc_next_chord()); }
+  if (block_buffer_prep == block_buffer_head) { return(NULL); }
+  block_t *block = &block_buffer[block_buffer_prep];
+  block_buffer_prep = next_block_index(block_buffer_prep);
+  // The segments will follow this trapezoid to its end, so the junction after it is final
+  if (block_buffer_planned == block - block_buffer) { block_buffer_planned = block_buffer_prep; }
+  if (block->type == BLOCK_ARC) {
+    arc_begin(block);
+    return(arc_next_chord());
+  }
+  prep_position[X_AXIS] += (block->direction_bits & (1<<X_DIRECTION_BIT)) ? -(int32_t)block->steps_x : block->steps_x;
+  prep_position[Y_AXIS] += (block->direction_bits & (1<<Y_DIRECTION_BIT)) ? -(int32_t)block->steps_y : block->steps_y;
+  prep_position[Z_AXIS] += (block->direction_bits & (1<<Z_DIRECTION_BIT)) ? -(int32_t)block->steps_z : block->steps_z;
+  return(block);
+}
+
+// Waits until the block at next_buffer_head is free. Returns FALSE if a reset came in and the block must
+// be dropped.
+static uint8_t plan_wait_for_block(uint8_t next_buffer_head) {
+	// If the buffer is full: good! That means we are well ahead of the robot. 
+	// Rest here until there is room in the buffer.
+	while(block_buffer_tail == next_buffer_head) { 
+		if (sp_execute & EXEC_RESET) { return(FALSE); } // The plan is about to be reset
+		st_prep_buffer();
+		st_pause_wait_resume();
+		if (sp_execute & EXEC_RESET) { return(FALSE); }
+		sleep_mode(); 
+	}
+	return(TRUE);
+}
+
+// Plans the block just set up at the buffer head and appends it. entry_vec and exit_vec are its directions 
+// of travel at the start and at the end.
+static void plan_push_block(int16_t *entry_vec, int16_t *exit_vec, double nominal_speed, double acceleration) {
+  block_t *block = &block_buffer[block_buffer_head];
+  block_plan_t *plan = &block_plan[block_buffer_head];
+  // The largest change in speed squared the acceleration allows within this block
+  if (plan->max_delta_speed_sqr < 1) { plan->max_delta_speed_sqr = 1; }
+  if (acceleration_manager_enabled) {
+    // Limit the speed at the junction with the previous block. Never go below the safe speed. If the buffer 
+    // is empty, or the stepper is already preparing the previous block to stop, we start at the safe speed.
+    plan->max_entry_speed_sqr = safe_speed_sqr;
+    if (block_buffer_head != block_buffer_planned) {
+      block_plan_t *previous = &block_plan[prev_block_index(block_buffer_head)];
+      speed_sqr_t vmax_junction_sqr = junction_speed_sqr(previous_unit_vec, previous_nominal_speed, entry_vec, 
+        nominal_speed, acceleration, min(previous->nominal_speed_sqr, plan->nominal_speed_sqr));
+      if (vmax_junction_sqr > plan->max_entry_speed_sqr) { plan->max_entry_speed_sqr = vmax_junction_sqr; }
+    }
+    // Until more blocks arrive this is the last block of the plan and must be able to slow down to the
+    // safe speed within its length
+    plan->entry_speed_sqr = plan->max_entry_speed_sqr;
+    speed_sqr_t max_entry_speed_sqr = safe_speed_sqr+plan->max_delta_speed_sqr;
+    if (max_entry_speed_sqr < plan->entry_speed_sqr) { plan->entry_speed_sqr = max_entry_speed_sqr; }
+    plan->recalculate_flag = TRUE;
+    // compute a preliminary conservative acceleration trapezoid
+    if (block->type == BLOCK_LINE) { calculate_trapezoid_for_block(block, plan, plan->entry_speed_sqr, safe_speed_sqr); }
+  } else if (block->type == BLOCK_LINE) {
+    plan_set_constant_rate(block);
+  }
+  memcpy(previous_unit_vec, exit_vec, sizeof(previous_unit_vec)); // previous_unit_vec[] = exit_vec[]
+  previous_nominal_speed = nominal_speed;
+  
+  // Move buffer head
+  block_buffer_head = next_block_index(block_buffer_head);
+  
+  if (acceleration_manager_enabled) { planner_recalculate(); }  
+  st_wake_up();
+}
+
 // Add a new linear movement to the buffer. steps_x, _y and _z is the absolute position in 
 // mm. Microseconds specify how many microseconds the move should take to perform. To aid acceleration
 // calculation the caller must also provide the physical length of the line in millimeters.
@@ -362,90 +866,149 @@ void plan_buffer_line(double x, double y, double z, double feed_rate, int invert
   target[Y_AXIS] = lround(y*settings.steps_per_mm[Y_AXIS]);
   target[Z_AXIS] = lround(z*settings.steps_per_mm[Z_AXIS]);     
   
-  // Calculate the buffer head after we push this byte
-	uint8_t next_buffer_head = (block_buffer_head + 1);
-	next_buffer_head = next_buffer_head % BLOCK_BUFFER_SIZE;	
-	// If the buffer is full: good! That means we are well ahead of the robot. 
-	// Rest here until there is room in the buffer.
-	uint8_t bufferWasFull = block_buffer_tail == next_buffer_head;
-	if( bufferWasFull)
-	{
-		//printPgmString(PSTR("::buf_full::\r\n"));
-	}
-	while(block_buffer_tail == next_buffer_head) { 
-		st_pause_wait_resume();
-		sleep_mode(); 
-	}
-	if(bufferWasFull)
-	{
-		//printPgmString(PSTR("::not_full::\r\n"));
-	}
-  // Prepare to set up new block
-  block_t *block = &block_buffer[block_buffer_head];
   // Number of steps for each axis
-  block->steps_x = labs(target[X_AXIS]-position[X_AXIS]);
-  block->steps_y = labs(target[Y_AXIS]-position[Y_AXIS]);
-  block->steps_z = labs(target[Z_AXIS]-position[Z_AXIS]);
-  block->step_event_count = max(block->steps_x, max(block->steps_y, block->steps_z));
+  uint32_t steps_x = labs(target[X_AXIS]-position[X_AXIS]);
+  uint32_t steps_y = labs(target[Y_AXIS]-position[Y_AXIS]);
+  uint32_t steps_z = labs(target[Z_AXIS]-position[Z_AXIS]);
+  uint32_t step_event_count = max(steps_x, max(steps_y, steps_z));
   // Bail if this is a zero-length block
-  if (block->step_event_count == 0) { return; };
+  if (step_event_count == 0) { return; };
+  // Blocks count step events in 16 bits. Buffer longer lines in two halves.
+  if (step_event_count > MAX_STEP_EVENTS) {
+    if (invert_feed_rate) { feed_rate *= 2; }
+    plan_buffer_line((position[X_AXIS]*mm_per_step[X_AXIS]+x)/2, (position[Y_AXIS]*mm_per_step[Y_AXIS]+y)/2,
+      (position[Z_AXIS]*mm_per_step[Z_AXIS]+z)/2, feed_rate, invert_feed_rate);
+    plan_buffer_line(x, y, z, feed_rate, invert_feed_rate);
+    return;
+  }
   
-  double delta_x_mm = (target[X_AXIS]-position[X_AXIS])/settings.steps_per_mm[X_AXIS];
-  double delta_y_mm = (target[Y_AXIS]-position[Y_AXIS])/settings.steps_per_mm[Y_AXIS];
-  double delta_z_mm = (target[Z_AXIS]-position[Z_AXIS])/settings.steps_per_mm[Z_AXIS];
-  block->millimeters = sqrt(square(delta_x_mm) + square(delta_y_mm) + square(delta_z_mm));
+  if (!plan_wait_for_block(next_block_index(block_buffer_head))) { return; }
+  // Prepare to set up new block
+  block_t *block = &block_buffer[block_buffer_head];
+  block_plan_t *plan = &block_plan[block_buffer_head];
+  double delta_mm[3];
+  double millimeters = plan_set_line_steps(block, position, target, delta_mm);
+  double inverse_millimeters = 1.0/millimeters;
 	
-  
-  uint32_t microseconds;
+  // Calculate the nominal speed in mm/minute
+  double nominal_speed;
   if (!invert_feed_rate) {
-    microseconds = lround((block->millimeters/feed_rate)*1000000);
+    nominal_speed = feed_rate*60.0;
   } else {
-    microseconds = lround(ONE_MINUTE_OF_MICROSECONDS/feed_rate);
+    nominal_speed = millimeters*feed_rate;
   }
   
-  // Calculate speed in mm/minute for each axis
-  double multiplier = 60.0*1000000.0/microseconds;
-  block->speed_x = delta_x_mm * multiplier;
-  block->speed_y = delta_y_mm * multiplier;
-  block->speed_z = delta_z_mm * multiplier; 
-  block->nominal_speed = block->millimeters * multiplier;
-  block->nominal_rate = ceil(block->step_event_count * multiplier);  
-  block->entry_factor = 0.0;
-  
-  // Compute the acceleration rate for the trapezoid generator. Depending on the slope of the line
-  // average travel per step event changes. For a line along one axis the travel per step event
-  // is equal to the travel/step in the particular axis. For a 45 degree line the steppers of both
-  // axes might step for every step event. Travel per step event is then sqrt(travel_x^2+travel_y^2).
-  // To generate trapezoids with contant acceleration between blocks the rate_delta must be computed 
-  // specifically for each line to compensate for this phenomenon:
-  double travel_per_step = block->millimeters/block->step_event_count;
-  block->rate_delta = ceil(
-    ((settings.acceleration*60.0)/(ACCELERATION_TICKS_PER_SECOND))/ // acceleration mm/sec/sec per acceleration_tick
-    travel_per_step);                                               // convert to: acceleration steps/min/acceleration_tick    
-  if (acceleration_manager_enabled) {
-    // compute a preliminary conservative acceleration trapezoid
-    double safe_speed_factor = factor_for_safe_speed(block);
-    calculate_trapezoid_for_block(block, safe_speed_factor, safe_speed_factor); 
-  } else {
-    block->initial_rate = block->nominal_rate;
-    block->final_rate = block->nominal_rate;
-    block->accelerate_until = 0;
-    block->decelerate_after = block->step_event_count;
-    block->rate_delta = 0;
+  // The direction of travel as a unit vector. Each axis moves at its component of the speed and the 
+  // acceleration, so clamp both to the most restrictive axis.
+  int16_t unit_vec[3];
+  double unit[3];
+  double acceleration = settings.acceleration;
+  uint8_t axis;
+  for (axis = X_AXIS; axis <= Z_AXIS; axis++) {
+    unit[axis] = delta_mm[axis]*inverse_millimeters;
+    unit_vec[axis] = lround(unit[axis]*UNIT_VECTOR_ONE);
   }
-  
-  // Compute direction bits for this block
-  block->direction_bits = 0;
-  if (target[X_AXIS] < position[X_AXIS]) { block->direction_bits |= (1<<X_DIRECTION_BIT); }
-  if (target[Y_AXIS] < position[Y_AXIS]) { block->direction_bits |= (1<<Y_DIRECTION_BIT); }
-  if (target[Z_AXIS] < position[Z_AXIS]) { block->direction_bits |= (1<<Z_DIRECTION_BIT); }
-  
-  // Move buffer head
-  block_buffer_head = next_buffer_head;     
+  plan_limit_to_axes(unit, &nominal_speed, &acceleration);
+  plan->nominal_speed_sqr = to_speed_sqr(square(nominal_speed));
+  plan->max_delta_speed_sqr = to_speed_sqr(2*acceleration*60*60*millimeters);
+  plan_set_line_rates(block, millimeters, nominal_speed, acceleration);
   // Update position 
   memcpy(position, target, sizeof(target)); // position[] = target[]
-  
-  if (acceleration_manager_enabled) { planner_recalculate(); }  
-  st_wake_up();
+  plan_push_block(unit_vec, unit_vec, nominal_speed, acceleration);
 }
 
+void plan_buffer_command(uint8_t type, uint32_t milliseconds) {
+  // Blocks count step events in 16 bits. Longer waits continue in dwell blocks.
+  while (milliseconds > MAX_STEP_EVENTS) {
+    plan_buffer_command(type, MAX_STEP_EVENTS);
+    type = BLOCK_DWELL;
+    milliseconds -= MAX_STEP_EVENTS;
+  }
+  if (type == BLOCK_DWELL && milliseconds == 0) { return; }
+  if (!plan_wait_for_block(next_block_index(block_buffer_head))) { return; }
+  block_t *block = &block_buffer[block_buffer_head];
+  block_plan_t *plan = &block_plan[block_buffer_head];
+  // A line without steps, at one step event per millisecond
+  int16_t unit_vec[3];
+  double delta_mm[3];
+  clear_vector(unit_vec);
+  plan_set_line_steps(block, position, position, delta_mm);
+  block->type = type;
+  block->step_event_count = max(milliseconds, 1);
+  block->nominal_rate = COMMAND_EVENTS_PER_MINUTE;
+  plan_set_constant_rate(block);
+  // Nothing moves at a nominal speed of 0: the junctions on both sides are at the safe speed
+  plan->nominal_speed_sqr = 0;
+  plan->max_delta_speed_sqr = 0;
+  plan_push_block(unit_vec, unit_vec, 0, settings.acceleration);
+}
+
+void plan_buffer_arc(double center_1, double center_2, double angular_travel, uint16_t chord_count, 
+  uint8_t axis_1, uint8_t axis_2, double *target, double feed_rate) {
+  uint8_t axis_linear = X_AXIS+Y_AXIS+Z_AXIS-axis_1-axis_2;
+  int32_t target_steps[3];
+  target_steps[X_AXIS] = lround(target[X_AXIS]*settings.steps_per_mm[X_AXIS]);
+  target_steps[Y_AXIS] = lround(target[Y_AXIS]*settings.steps_per_mm[Y_AXIS]);
+  target_steps[Z_AXIS] = lround(target[Z_AXIS]*settings.steps_per_mm[Z_AXIS]);
+  arc_t arc;
+  arc.center[0] = center_1;
+  arc.center[1] = center_2;
+  arc.axis_1 = axis_1;
+  arc.axis_2 = axis_2;
+  double vec[2], theta, radius;
+  arc_start(&arc, position, vec, &theta, &radius);
+  // A single chord, or a circle a few steps across, is just a line
+  if (chord_count < 2 || radius*min(settings.steps_per_mm[axis_1], settings.steps_per_mm[axis_2]) < 2) {
+    plan_buffer_line(target[X_AXIS], target[Y_AXIS], target[Z_AXIS], feed_rate, FALSE);
+    return;
+  }
+  // Bail if a short arc ends on the step it starts from. Then none of its chords may step. A full circle
+  // of at least two steps radius always steps.
+  if (fabs(angular_travel) < M_PI && target_steps[X_AXIS] == position[X_AXIS] && 
+    target_steps[Y_AXIS] == position[Y_AXIS] && target_steps[Z_AXIS] == position[Z_AXIS]) { return; }
+  // Blocks count step events in 16 bits. Keep the chords shorter than that.
+  double linear_steps = target_steps[axis_linear]-position[axis_linear];
+  double travel_steps = max(fabs(angular_travel)*radius*max(settings.steps_per_mm[axis_1], 
+    settings.steps_per_mm[axis_2]), fabs(linear_steps));
+  if (travel_steps > (double)chord_count*(MAX_STEP_EVENTS-1)) { chord_count = ceil(travel_steps/(MAX_STEP_EVENTS-1)); }
+  arc.theta_per_chord = angular_travel/chord_count;
+  arc.steps_per_chord = linear_steps/chord_count;
+  arc.target[0] = target_steps[axis_1];
+  arc.target[1] = target_steps[axis_2];
+  arc.chord_count = chord_count;
+  arc.accelerated = acceleration_manager_enabled;
+
+  // Each axis moves at its share of the chords, so clamp the speed and the acceleration to the most 
+  // restrictive axis
+  double share[3];
+  double chord_mm = arc_chord_shares(&arc, radius, share);
+  double nominal_speed = feed_rate*60.0;
+  double acceleration = settings.acceleration;
+  plan_limit_to_axes(share, &nominal_speed, &acceleration);
+  int16_t entry_vec[3], exit_vec[3];
+  arc_chord_vector(&arc, theta, radius, 1, entry_vec);
+  arc_chord_vector(&arc, theta, radius, chord_count, exit_vec);
+  speed_sqr_t nominal_speed_sqr = to_speed_sqr(square(nominal_speed));
+  if (acceleration_manager_enabled) {
+    // The corners between the chords limit the speed along the whole arc, but never below the safe speed
+    int16_t second_vec[3];
+    arc_chord_vector(&arc, theta, radius, 2, second_vec);
+    speed_sqr_t corner_speed_sqr = junction_speed_sqr(entry_vec, nominal_speed, second_vec, nominal_speed, 
+      acceleration, nominal_speed_sqr);
+    if (corner_speed_sqr < safe_speed_sqr) { corner_speed_sqr = safe_speed_sqr; }
+    if (corner_speed_sqr < nominal_speed_sqr) { 
+      nominal_speed_sqr = corner_speed_sqr; 
+      nominal_speed = speed_for_speed_sqr(nominal_speed_sqr);
+    }
+  }
+
+  if (!plan_wait_for_block(next_block_index(block_buffer_head))) { return; }
+  block_t *block = &block_buffer[block_buffer_head];
+  block_plan_t *plan = &block_plan[block_buffer_head];
+  block->type = BLOCK_ARC;
+  block->arc = arc;
+  plan->nominal_speed_sqr = nominal_speed_sqr;
+  plan->max_delta_speed_sqr = to_speed_sqr(2*acceleration*60*60*chord_mm*chord_count);
+  memcpy(position, target_steps, sizeof(target_steps)); // position[] = target_steps[]
+  plan_push_block(entry_vec, exit_vec, nominal_speed, acceleration);
+}
@@ -25,48 +25,114 @@
 #define planner_h
                  
 #include <inttypes.h>
+#include "config.h"
+
+// Speeds squared in (mm/min)^2 as used by the lookahead. The fixed point planner keeps them as integers
+// with 4 fractional bits.
+#ifdef PLANNER_FIXED_POINT
+typedef uint32_t speed_sqr_t;
+#else
+typedef double speed_sqr_t;
+#endif
+
+// The block types
+#define BLOCK_LINE 0        // A line, traced by the stepper interrupt as it is
+#define BLOCK_ARC 1         // An arc. plan_get_next_prep_block() hands it to the stepper as a series of chords
+#define BLOCK_LAST_CHORD 2  // The last chord of an arc. The arc is done when the stepper has traced it
+// Command blocks. The stepper runs them in turn with the motion and then waits step_event_count milliseconds, 
+// traced as a line without steps.
+#define BLOCK_DWELL 3
+#define BLOCK_SPINDLE_RUN 4
+#define BLOCK_SPINDLE_STOP 5
+
+// What plan_get_next_prep_block() needs to cut an arc into chords. It takes the place of the line fields, 
+// which an arc doesn't use. The chords start at the end of the block before.
+typedef struct {
+  double center[2];                   // The center in mm along axis_1 and axis_2
+  double theta_per_chord;             // The angle each chord turns by, positive is clockwise (see mc_arc())
+  double steps_per_chord;             // The steps each chord moves along the third axis
+  int32_t target[2];                  // The end in steps along axis_1 and axis_2
+  uint16_t chord_count;
+  uint8_t axis_1, axis_2;
+  uint8_t accelerated;                // TRUE if the acceleration manager plans the arc
+} arc_t;
 
 // This struct is used when buffering the setup for each linear movement "nominal" values are as specified in 
-// the source g-code and may never actually be reached if acceleration management is active.
+// the source g-code and may never actually be reached if acceleration management is active. It only holds
+// what the stepper interrupt reads. The planner keeps the rest in the block_plan_t at the same index.
 typedef struct {
-  // Fields used by the bresenham algorithm for tracing the line
-  uint32_t steps_x, steps_y, steps_z; // Step count along each axis
-  uint8_t  direction_bits;            // The direction bit set for this block (refers to *_DIRECTION_BIT in config.h)
-  int32_t  step_event_count;          // The number of step events required to complete this block
-  uint32_t nominal_rate;              // The nominal step rate for this block in step_events/minute
-  
-  // Fields used by the motion planner to manage acceleration
-  double speed_x, speed_y, speed_z;   // Nominal mm/minute for each axis
-  double nominal_speed;               // The nominal speed for this block in mm/min  
-  double millimeters;                 // The total travel of this block in mm
-  double entry_factor;                // The factor representing the change in speed at the start of this trapezoid.
-                                      // (The end of the curren speed trapezoid is defined by the entry_factor of the
-                                      // next block)
-  
-  // Settings for the trapezoid generator
-  uint32_t initial_rate;              // The jerk-adjusted step rate at start of block  
-  uint32_t final_rate;                // The minimal rate at exit
-  int32_t rate_delta;                 // The steps/minute to add or subtract when changing speed (must be positive)
-  uint32_t accelerate_until;          // The index of the step event on which to stop acceleration
-  uint32_t decelerate_after;          // The index of the step event on which to start decelerating
-  
+  uint8_t type;                         // BLOCK_LINE, BLOCK_ARC, BLOCK_LAST_CHORD or a command
+  union {
+    struct {
+      // Fields used by the bresenham algorithm for tracing the line
+      uint16_t steps_x, steps_y, steps_z; // Step count along each axis
+      uint16_t step_event_count;          // The number of step events required to complete this block
+      uint8_t  direction_bits;            // The direction bit set for this block (refers to *_DIRECTION_BIT in config.h)
+      uint32_t nominal_rate;              // The nominal step rate for this block in step_events/minute
+      
+      // Settings for the trapezoid generator
+      uint32_t initial_rate;              // The jerk-adjusted step rate at start of block  
+      uint32_t final_rate;                // The minimal rate at exit
+      uint32_t acceleration;              // The acceleration in step_events/minute/minute (must be positive)
+      uint16_t accelerate_until;          // The index of the step event on which to stop acceleration
+      uint16_t decelerate_after;          // The index of the step event on which to start decelerating
+    };
+    arc_t arc;                            // BLOCK_ARC only
+  };
 } block_t;
+
+// The fields used by the motion planner to manage acceleration. The stepper interrupt never reads these.
+typedef struct {
+  speed_sqr_t nominal_speed_sqr;      // The nominal speed for this block squared
+  speed_sqr_t max_delta_speed_sqr;    // 2*acceleration*millimeters: the largest change in speed squared within the block
+  speed_sqr_t entry_speed_sqr;        // The planned speed at the start of this trapezoid squared. (The end of the 
+                                      // current speed trapezoid is defined by the entry speed of the next block)
+  speed_sqr_t max_entry_speed_sqr;    // The cornering limited entry speed squared. Computed once when the block 
+                                      // is buffered
+  uint8_t recalculate_flag;           // Set when the entry_speed changed and the trapezoid must be recalculated
+} block_plan_t;
       
 // Initialize the motion plan subsystem      
 void plan_init();
 
+// Refreshes the values the planner derives from the settings. Call after changing a setting.
+void plan_load_settings();
+
 // Add a new linear movement to the buffer. x, y and z is the signed, absolute target position in 
 // millimaters. Feed rate specifies the speed of the motion. If feed rate is inverted, the feed
 // rate is taken to mean "frequency" and would complete the operation in 1/feed_rate minutes.
 void plan_buffer_line(double x, double y, double z, double feed_rate, int invert_feed_rate);
 
-// Called when the current block is no longer needed. Discards the block and makes the memory
-// availible for new blocks.
+// Add a new arc to the buffer. It takes one block however many chords it is traced with. The arc starts at 
+// the current position and turns around the center at center_1, center_2 along axis_1, axis_2 by angular_travel
+// radians (positive is clockwise, see mc_arc()) in chord_count chords, while the third axis moves on in a 
+// helix. target is the end in millimeters and feed_rate the speed in mm/sec.
+void plan_buffer_arc(double center_1, double center_2, double angular_travel, uint16_t chord_count, 
+  uint8_t axis_1, uint8_t axis_2, double *target, double feed_rate);
+
+// Add a command to the buffer: BLOCK_DWELL, BLOCK_SPINDLE_RUN or BLOCK_SPINDLE_STOP. The stepper runs it once 
+// the motion before it is done and waits the given time before it goes on. The motion before it ends at the 
+// safe speed.
+void plan_buffer_command(uint8_t type, uint32_t milliseconds);
+
+// Called when the stepper has traced the current block, or the current chord of an arc. Discards the block 
+// once done and makes the memory availible for new blocks.
 inline void plan_discard_current_block();
 
 // Gets the current block. Returns NULL if buffer empty
 inline block_t *plan_get_current_block();
 
+// Returns the speed in mm/min of the block being executed when stepping at the given rate in 
+// step_events/minute. 0 if there is no block.
+double plan_get_current_speed(uint32_t steps_per_minute);
+
+// Returns the number of lines that can be buffered without waiting
+uint8_t plan_get_free_block_count();
+
+// Gets the next block for the stepper segment buffer, i.e. the one after the block returned last time, or the
+// next chord of an arc. Returns NULL if there is none yet. The returned block's trapezoid will not be replanned.
+block_t *plan_get_next_prep_block();
+
 // Enables or disables acceleration-management for upcoming blocks
 void plan_set_acceleration_manager_enabled(int enabled);
 
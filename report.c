@@ -0,0 +1,204 @@
+/*
+  report.c - all the messages sent to the host
+  Part of Grbl
+
+  Copyright (c) 2009-2011 Simen Svale Skogsrud
+
+  Grbl is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Grbl is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Grbl.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Everything Grbl prints goes through here, so settings.verbosity decides what reaches the host.
+
+#include <avr/pgmspace.h>
+#include "report.h"
+#include "config.h"
+#include "nuts_bolts.h"
+#include "settings.h"
+#include "gcode.h"
+#include "stepper.h"
+#include "planner.h"
+#include "motion_control.h"
+#include "wiring_serial.h"
+
+void report_status_message(uint8_t status_code) {
+  if (status_code == GCSTATUS_OK) {
+    // Tell the host how much it can send: free bytes in the receive buffer and free planner blocks
+    printPgmString(PSTR("ok R"));
+    printInteger(serialRxFree());
+    printPgmString(PSTR(" P"));
+    printInteger(plan_get_free_block_count());
+    printPgmString(PSTR("\n\r"));
+    return;
+  }
+  if (settings.verbosity < VERBOSITY_VERBOSE) {
+    printPgmString(PSTR("error: "));
+    printInteger(status_code);
+    printPgmString(PSTR("\n\r"));
+    return;
+  }
+  switch(status_code) {
+    case GCSTATUS_BAD_NUMBER_FORMAT:
+    printPgmString(PSTR("error: Bad number format\n\r")); break;
+    case GCSTATUS_EXPECTED_COMMAND_LETTER:
+    printPgmString(PSTR("error: Expected command letter\n\r")); break;
+    case GCSTATUS_UNSUPPORTED_STATEMENT:
+    printPgmString(PSTR("error: Unsupported statement\n\r")); break;
+    case GCSTATUS_FLOATING_POINT_ERROR:
+    printPgmString(PSTR("error: Floating point error\n\r")); break;
+    case GCSTATUS_TOO_MANY_WORDS:
+    printPgmString(PSTR("error: Too many words\n\r")); break;
+    case GCSTATUS_BAD_FRAME:
+    printPgmString(PSTR("error: Bad frame\n\r")); break;
+    case GCSTATUS_LINE_TOO_LONG:
+    printPgmString(PSTR("error: Line too long\n\r")); break;
+    default:
+    printPgmString(PSTR("error: "));
+    printInteger(status_code);
+    printPgmString(PSTR("\n\r"));
+  }
+}
+
+void report_echo_line(char *line) {
+  if (settings.verbosity < VERBOSITY_VERBOSE) { return; }
+  printString(line);
+  print_newline();
+}
+
+void report_feedback_message(const char *message) {
+  if (settings.verbosity < VERBOSITY_TERSE) { return; }
+  printPgmString(message);
+  print_newline();
+}
+
+void report_alarm_message(const char *message) {
+  printPgmString(message);
+  print_newline();
+}
+
+void report_debug_value(const char *label, long value) {
+  if (settings.verbosity < VERBOSITY_VERBOSE) { return; }
+  printPgmString(label);
+  printInteger(value);
+  print_newline();
+}
+
+// Returns the number of free bytes between the static data or heap and the stack
+static size_t free_sram()
+{
+	extern char __heap_start, *__brkval;
+	char top_of_stack;
+	return(&top_of_stack - (__brkval == 0 ? &__heap_start : __brkval));
+}
+
+void report_build_info()
+{
+	printPgmString(PSTR("\r\nMezzoMill "));
+	printPgmString(PSTR(MM_VERSION));
+	print_newline();
+	printPgmString(PSTR("Blocks: "));
+	printInteger(BLOCK_BUFFER_SIZE);
+	printPgmString(PSTR(" x "));
+	printInteger(sizeof(block_t)+sizeof(block_plan_t));
+	printPgmString(PSTR(" bytes, free SRAM: "));
+	printInteger(free_sram());
+	print_newline();
+}
+
+void report_settings() {
+  // MM_COMMENT - I added $10
+  printPgmString(PSTR("$10=0 (resets to defaut settings but the baud rate. Reboot for them to take effect.)\r\n"));
+  printPgmString(PSTR("$0 = ")); printFloat(settings.steps_per_mm[X_AXIS]);
+  printPgmString(PSTR(" (steps/mm x)\r\n$1 = ")); printFloat(settings.steps_per_mm[Y_AXIS]);
+  printPgmString(PSTR(" (steps/mm y)\r\n$2 = ")); printFloat(settings.steps_per_mm[Z_AXIS]);
+  printPgmString(PSTR(" (steps/mm z)\r\n$3 = ")); printInteger(settings.pulse_microseconds);
+  printPgmString(PSTR(" (microseconds step pulse)\r\n$4 = ")); printFloat(settings.default_feed_rate);
+  printPgmString(PSTR(" (mm/min default feed rate)\r\n$5 = ")); printFloat(settings.default_seek_rate);
+  printPgmString(PSTR(" (mm/min default seek rate)\r\n$6 = ")); printFloat(settings.mm_per_arc_segment);
+  printPgmString(PSTR(" (mm/arc segment)\r\n$7 = ")); printInteger(settings.invert_mask);
+  printPgmString(PSTR(" (step port invert mask. binary = ")); printIntegerInBase(settings.invert_mask, 2);
+  printPgmString(PSTR(")\r\n$8 = ")); printFloat(settings.acceleration);
+  printPgmString(PSTR(" (path acceleration in mm/sec^2)\r\n$9 = ")); printFloat(settings.max_jerk);
+  printPgmString(PSTR(" (max instant cornering speed change in delta mm/min)\r\n$11 = ")); printFloatDecimals(settings.junction_deviation, 4);
+  printPgmString(PSTR(" (cornering junction deviation in mm, 0 = limit corners by max jerk)\r\n$12 = ")); printFloat(settings.max_acceleration[X_AXIS]);
+  printPgmString(PSTR(" (acceleration x in mm/sec^2)\r\n$13 = ")); printFloat(settings.max_acceleration[Y_AXIS]);
+  printPgmString(PSTR(" (acceleration y in mm/sec^2)\r\n$14 = ")); printFloat(settings.max_acceleration[Z_AXIS]);
+  printPgmString(PSTR(" (acceleration z in mm/sec^2)\r\n$15 = ")); printFloat(settings.max_rate[X_AXIS]);
+  printPgmString(PSTR(" (mm/min max rate x)\r\n$16 = ")); printFloat(settings.max_rate[Y_AXIS]);
+  printPgmString(PSTR(" (mm/min max rate y)\r\n$17 = ")); printFloat(settings.max_rate[Z_AXIS]);
+  printPgmString(PSTR(" (mm/min max rate z)\r\n$18 = ")); printInteger(settings.verbosity);
+  printPgmString(PSTR(" (verbosity: 0 = quiet, 1 = terse, 2 = verbose)\r\n$19 = ")); printInteger(settings.baud_rate);
+  printPgmString(PSTR(" (baud rate, confirm with '$$' at the new rate)\r\n$20 = ")); printFloatDecimals(settings.arc_tolerance, 4);
+  printPgmString(PSTR(" (arc tolerance in mm, 0 = segment arcs by $6)"));
+  printPgmString(PSTR("\r\n'$x=value' to set parameter or just '$' to dump current settings, '$$' for the build"));
+  printPgmString(PSTR(" info and '$U' for the serial receive counters\r\n"));
+}
+
+// e.g. "Serial: overruns 0, framing errors 0, dropped 0, rejected lines 0, peak RX 87/127"
+void report_serial_health()
+{
+  serial_health_t health;
+  serialGetHealth(&health);
+  printPgmString(PSTR("Serial: overruns ")); printInteger(health.overruns);
+  printPgmString(PSTR(", framing errors ")); printInteger(health.framing_errors);
+  printPgmString(PSTR(", dropped ")); printInteger(health.dropped);
+  printPgmString(PSTR(", rejected lines ")); printInteger(health.rejected_lines);
+  printPgmString(PSTR(", peak RX ")); printInteger(health.peak);
+  printByte('/'); printInteger(serialRxFree()+serialAvailable());
+  print_newline();
+}
+
+// Reports the state of the machine in answer to '?', e.g.
+// "<Run,MPos:12.000,-3.500,1.000,Blocks:7,RX:42,F:600.000>". MPos is where the steppers are in mm,
+// Blocks the number of lines in the planner, RX the bytes waiting in the receive buffer and F the
+// current feed rate in mm/min.
+void report_realtime_status()
+{
+  int32_t position[3];
+  uint32_t step_rate = st_get_step_rate();
+  st_get_position(position);
+  if (mc_is_homing()) {
+    printPgmString(PSTR("<Home"));
+  } else if (st_is_held()) {
+    printPgmString(PSTR("<Hold"));
+  } else if (plan_get_current_block()) {
+    printPgmString(PSTR("<Run"));
+  } else {
+    printPgmString(PSTR("<Idle"));
+  }
+  printPgmString(PSTR(",MPos:"));
+  printFloat(position[X_AXIS]/settings.steps_per_mm[X_AXIS]);
+  printByte(',');
+  printFloat(position[Y_AXIS]/settings.steps_per_mm[Y_AXIS]);
+  printByte(',');
+  printFloat(position[Z_AXIS]/settings.steps_per_mm[Z_AXIS]);
+  printPgmString(PSTR(",Blocks:"));
+  printInteger(BLOCK_BUFFER_SIZE-1-plan_get_free_block_count());
+  printPgmString(PSTR(",RX:"));
+  printInteger(serialAvailable());
+  printPgmString(PSTR(",F:"));
+  printFloat(plan_get_current_speed(step_rate));
+  printPgmString(PSTR(">"));
+  print_newline();
+}
+
+void report_cap_value(const char *label, int timed_out, double value)
+{
+	printPgmString(label);
+	if (timed_out) {
+		print_timed_out();
+	} else {
+		printFloat(value);
+	}
+	print_newline();
+}
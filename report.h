@@ -0,0 +1,63 @@
+/*
+  report.h - all the messages sent to the host
+  Part of Grbl
+
+  Copyright (c) 2009-2011 Simen Svale Skogsrud
+
+  Grbl is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Grbl is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Grbl.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef report_h
+#define report_h
+
+#include <inttypes.h>
+
+// The verbosity levels of settings.verbosity. Quiet only acknowledges, reports errors by number and
+// answers queries. Terse also tells what the machine is doing. Verbose echoes every line, spells out
+// errors and adds debugging output.
+#define VERBOSITY_QUIET 0
+#define VERBOSITY_TERSE 1
+#define VERBOSITY_VERBOSE 2
+
+// Acknowledges a line with "ok" and the free space of the buffers or reports the error
+void report_status_message(uint8_t status_code);
+
+// Echoes a received line (verbose)
+void report_echo_line(char *line);
+
+// Prints a message in program memory about what the machine is doing (terse and verbose)
+void report_feedback_message(const char *message);
+
+// Prints a message in program memory about a problem the host must hear of (all levels)
+void report_alarm_message(const char *message);
+
+// Prints a label in program memory and a value (verbose)
+void report_debug_value(const char *label, long value);
+
+// Prints the version and the buffer sizes. Sent after power up and reset and in answer to '$$'
+void report_build_info();
+
+// Prints the settings in answer to '$'
+void report_settings();
+
+// Prints the state of the machine in answer to '?'
+void report_realtime_status();
+
+// Prints the receive health counters in answer to '$U'
+void report_serial_health();
+
+// Prints a capacitance reading in answer to G31
+void report_cap_value(const char *label, int timed_out, double value);
+
+#endif
@@ -0,0 +1,198 @@
+require 'optparse'
+
+# Compiles g-code into a mix of text lines and binary motion frames (see serial_protocol.h and gcode.h
+# in the firmware). Simple G0-G3 moves become frames, everything else is passed on as text. Stream the
+# result with stream.rb as usual.
+
+FRAME_START = 0x01
+FRAME_ESCAPE = 0x1b
+FRAME_ESCAPE_XOR = 0x40
+FRAME_ESCAPED = [FRAME_START, FRAME_ESCAPE, 0x18, '!'.ord, '?'.ord, '~'.ord, "\n".ord, "\r".ord]
+
+FRAME_X, FRAME_Y, FRAME_Z, FRAME_F, FRAME_I, FRAME_J = (2..7).map { |bit| 1 << bit }
+
+options_parser = OptionParser.new do |opts|
+  opts.banner = "Usage: gcode_compiler [options] gcode-file output-file"
+  opts.on('-v', '--verbose', 'Print each compiled line') do
+    $verbose = true
+  end
+
+  opts.on('-h', '--help', 'Display this screen') do
+    puts opts
+    exit
+  end
+end
+options_parser.parse!
+if ARGV.length != 2
+  puts options_parser
+  exit
+end
+
+def varint(value)
+  bytes = []
+  begin
+    byte = value & 0x7f
+    value >>= 7
+    bytes << (value == 0 ? byte : byte | 0x80)
+  end while value != 0
+  bytes
+end
+
+def signed_varint(value)
+  varint(value >= 0 ? value << 1 : ((-value) << 1) - 1)
+end
+
+# CRC-16 CCITT, reflected, as avr-libc's _crc_ccitt_update
+def crc_ccitt(bytes)
+  bytes.inject(0xffff) do |crc, byte|
+    crc ^= byte
+    8.times { crc = (crc & 1) == 1 ? (crc >> 1) ^ 0x8408 : crc >> 1 }
+    crc
+  end
+end
+
+def frame(payload)
+  body = [payload.length] + payload
+  crc = crc_ccitt(body)
+  body += [crc >> 8, crc & 0xff]
+  escaped = body.map { |byte| FRAME_ESCAPED.include?(byte) ? [FRAME_ESCAPE, byte ^ FRAME_ESCAPE_XOR] : byte }
+  ([FRAME_START] + escaped.flatten).pack('C*')
+end
+
+# Tracks the modal state of the firmware's parser, as far as frames depend on it
+class Compiler
+  def initialize
+    @inches = false
+    @absolute = true
+    @xy_plane = true
+    @inverse_feed = false
+    @motion = 0 # nil after G80, until G0-G3 set a motion mode again
+    @position = [nil, nil, nil] # In micrometers, nil until a text line sets it
+    @frames = 0
+    @lines = 0
+  end
+
+  attr_reader :frames, :lines
+
+  def micrometers(value)
+    (value * (@inches ? 25400 : 1000)).round
+  end
+
+  # Returns the compiled line for one line of g-code
+  def compile(line)
+    words = line.gsub(/\(.*?\)|;.*/, '').upcase.delete(" \t").scan(/([A-Z])([-+]?[0-9.]+)/)
+    payload = frame_payload(words)
+    track(words)
+    if payload
+      @frames += 1
+      frame(payload)
+    else
+      @lines += 1
+      line
+    end
+  end
+
+  # The payload for a move that fits a frame, nil otherwise
+  def frame_payload(words)
+    return nil if words.empty? || @inverse_feed
+    motion = @motion
+    axes = {}
+    feed = nil
+    offsets = {}
+    words.each do |letter, value|
+      value = value.to_f
+      case letter
+      when 'G'
+        return nil unless [0, 1, 2, 3].include?(value)
+        motion = value.to_i
+      when 'X', 'Y', 'Z'
+        axes[letter] = value
+      when 'F'
+        feed = value * (@inches ? 25.4 : 1)
+        return nil if (feed - feed.round).abs > 1e-6 || feed < 0
+        feed = feed.round
+      when 'I', 'J'
+        offsets[letter] = micrometers(value)
+      when 'N'
+        next
+      else
+        return nil
+      end
+    end
+    return nil if axes.empty? || motion.nil?
+    return nil if motion >= 2 && (!@xy_plane || offsets.empty?)
+    return nil if motion < 2 && !offsets.empty?
+
+    opcode = motion
+    fields = []
+    %w(X Y Z).each_with_index do |letter, axis|
+      next unless axes[letter]
+      return nil unless @position[axis]
+      delta = micrometers(axes[letter])
+      delta -= @position[axis] if @absolute
+      opcode |= FRAME_X << axis
+      fields += signed_varint(delta)
+    end
+    if feed
+      opcode |= FRAME_F
+      fields += varint(feed)
+    end
+    %w(I J).each_with_index do |letter, axis|
+      next unless offsets[letter]
+      opcode |= FRAME_I << axis
+      fields += signed_varint(offsets[letter])
+    end
+    [opcode] + fields
+  end
+
+  # Follows the modal state and the position through the line
+  def track(words)
+    move = true
+    words.each do |letter, value|
+      next unless letter == 'G'
+      case value.to_f
+      when 0, 1, 2, 3 then @motion = value.to_i
+      when 17 then @xy_plane = true
+      when 18, 19 then @xy_plane = false
+      when 20 then @inches = true
+      when 21 then @inches = false
+      when 90 then @absolute = true
+      when 91 then @absolute = false
+      when 93 then @inverse_feed = true
+      when 94 then @inverse_feed = false
+      when 4 then move = false
+      when 80 then @motion = nil # The firmware cancels the motion mode, so axis words alone don't move
+      when 35, 36 then nil
+      when 53 then @absolute_once = true
+      else
+        # Homing, probing and redefining the origin leave the position to the firmware
+        @position = [nil, nil, nil]
+        move = false
+      end
+    end
+    absolute = @absolute || @absolute_once
+    @absolute_once = false
+    return unless move
+    words.each do |letter, value|
+      axis = %w(X Y Z).index(letter)
+      next unless axis
+      if absolute
+        @position[axis] = micrometers(value.to_f)
+      elsif @position[axis]
+        @position[axis] += micrometers(value.to_f)
+      end
+    end
+  end
+end
+
+compiler = Compiler.new
+File.open(ARGV[1], 'wb') do |output|
+  File.readlines(ARGV[0]).each do |line|
+    line = line.strip
+    next if line == ''
+    compiled = compiler.compile(line)
+    puts compiled.inspect if $verbose
+    output.write("#{compiled}\n")
+  end
+end
+puts "#{compiler.frames} frames, #{compiler.lines} text lines"
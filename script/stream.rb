@@ -12,6 +12,14 @@ options_parser = OptionParser.new do |opts|
   opts.on('-p', '--prebuffer', 'Prebuffer commands') do
     $prebuffer = true
   end   
+
+  opts.on('-a', '--aggressive', 'Keep the receive buffer full, counting characters against its reported size') do
+    $aggressive = true
+  end   
+  
+  opts.on('-b', '--baud RATE', Integer, 'Switch Grbl and the port to this baud rate before streaming') do |rate|
+    $baud = rate
+  end   
   
   opts.on('-h', '--help', 'Display this screen') do
     puts opts
@@ -24,22 +32,64 @@ if ARGV.empty?
   exit
 end
 
+# Reads the lines to send. Binary frames from gcode_compiler.rb start with 0x01 and are kept byte for byte.
+def read_lines(file)
+  File.open(file, 'rb') { |f| f.readlines }.map { |line| line[0] == "\x01" ? line.chomp("\n") : line.strip }.reject { |line| line == '' }
+end
+
+# Reads until Grbl acknowledges a line with "ok R<free receive bytes> P<free planner blocks>" or an error
+def read_ack(sp)
+  begin
+    result = sp.gets.strip
+    puts "Grbl >> #{result}" #unless result == 'ok'
+  end while !(result =~ /^ok|^error/)
+  result
+end
+
+# Sends the lines as long as they fit in Grbl's receive buffer. Every line that is sent but not yet 
+# acknowledged is still in the buffer, so the host only needs to count characters. The size of the 
+# buffer is the free space reported by the first ack, when nothing else is in flight.
+def stream_aggressive(sp, lines)
+  in_flight = []
+  rx_size = nil
+  lines.each do |line|
+    length = line.length + 1
+    while !in_flight.empty? && (rx_size.nil? || in_flight.inject(0, :+) + length > rx_size)
+      result = read_ack(sp)
+      in_flight.shift
+      rx_size ||= $1.to_i if result =~ / R(\d+)/
+    end
+    puts line.inspect if $verbose
+    sp.write("#{line}\n")
+    in_flight << length
+  end
+  read_ack(sp) while in_flight.shift
+end
+
 # SerialPort.open('/dev/tty.FireFly-A964-SPP-1', 115200) do |sp|
 SerialPort.open('/dev/tty.usbserial-A700e0GO', 9600) do |sp|
   sp.write("\r\n\r\n");
   sleep 1
+  if $baud
+    # Grbl acknowledges $19 at the old rate, then waits for "$$" at the new one
+    sp.write("$19=#{$baud}\n")
+    read_ack(sp)
+    sp.baud = $baud
+    sp.write("$$\n")
+    read_ack(sp)
+  end
   ARGV.each do |file|
     puts "Processing file #{file}"
+    if $aggressive
+      stream_aggressive(sp, read_lines(file))
+      next
+    end
     prebuffer = $prebuffer ? 20 : 0
-    File.readlines(file).each do |line|
-      next if line.strip == ''
-      puts line.strip
-      sp.write("#{line.strip}\r\n");
+    read_lines(file).each do |line|
+      puts line.inspect
+      sp.write("#{line}\r\n");
       if prebuffer == 0
-        begin
-          result = sp.gets.strip
-          puts "Grbl >> #{result}" #unless result == 'ok'
-        end while !(result =~ /^ok|^error/)
+        read_ack(sp)
       else
         prebuffer -= 1
       end
@@ -30,65 +30,156 @@
 //#define LINE_BUFFER_SIZE 50
 
 #include "stepper.h"
+#include "planner.h"
+#include "spindle_control.h"
+#include "motion_control.h"
+#include "report.h"
+#include <avr/interrupt.h>
+#include <util/crc16.h>
+#include <util/delay.h>
 
 static char line[LINE_BUFFER_SIZE];
-static uint8_t char_counter;
+
+volatile uint8_t sp_execute;
 
 uint8_t paused;
 
-void status_message(int status_code) {
-  switch(status_code) {          
-    case GCSTATUS_OK:
-    st_pause_wait_resume(); 
-    printPgmString(PSTR("ok\n\r")); break;
-    case GCSTATUS_BAD_NUMBER_FORMAT:
-    printPgmString(PSTR("error: Bad number format\n\r")); break;
-    case GCSTATUS_EXPECTED_COMMAND_LETTER:
-    printPgmString(PSTR("error: Expected command letter\n\r")); break;
-    case GCSTATUS_UNSUPPORTED_STATEMENT:
-    printPgmString(PSTR("error: Unsupported statement\n\r")); break;
-    case GCSTATUS_FLOATING_POINT_ERROR:
-    printPgmString(PSTR("error: Floating point error\n\r")); break;
-    default:
-    printPgmString(PSTR("error: "));
-    printInteger(status_code);
-    printPgmString(PSTR("\n\r"));
-  }
+// Acknowledges a line once the machine may go on, or reports its error
+static void sp_acknowledge(uint8_t status_code) {
+  if (status_code == GCSTATUS_OK) { st_pause_wait_resume(); }
+  report_status_message(status_code);
 }
 
 void sp_init_must_be_first()
 {
-	 beginSerial();
+	 beginSerial(BAUD_RATE);
 }
 
 void sp_init() 
 {
   paused = FALSE;
-  sp_millInfo();
+  if (settings.baud_rate != serialBaudRate()) {
+    serialDrain();
+    beginSerial(settings.baud_rate);
+    // beginSerial() falls back to BAUD_RATE for a stored rate the UART can't do. Run at that rate, or the
+    // first line would start a $19 trial.
+    settings.baud_rate = serialBaudRate();
+  }
+  report_build_info();
+  report_feedback_message(PSTR("'$' to dump current settings"));
+}
+
+// Waits BAUD_RATE_TRIAL_MS for the line "$$". Anything else fails.
+static uint8_t sp_baud_rate_confirmed()
+{
+  uint16_t ms;
+  for (ms = 0; ms < BAUD_RATE_TRIAL_MS; ms++) {
+    if (serialReadLine(line) != -1) { return((line[0] == '$') && (line[1] == '$') && (line[2] == 0)); }
+    _delay_ms(1);
+  }
+  return(FALSE);
+}
+
+// Switches to the baud rate just set with $19. Once the machine has stopped, acknowledges the $19 line at the
+// old rate and switches. The host switches after that ok and confirms with a "$$" line at the new rate, which is
+// answered as usual. Without it Grbl goes back to the old rate and drops what it received in the meantime.
+static void sp_change_baud_rate()
+{
+  uint32_t old_rate = serialBaudRate();
+  st_synchronize();
+  sp_acknowledge(GCSTATUS_OK);
+  serialDrain();
+  beginSerial(settings.baud_rate);
+  if (sp_baud_rate_confirmed()) {
+    settings_write();
+    report_build_info();
+    sp_acknowledge(GCSTATUS_OK);
+  } else {
+    settings.baud_rate = old_rate;
+    beginSerial(old_rate);
+    serialFlush();
+    sp_execute = 0; // Probably noise at the wrong rate
+    report_alarm_message(PSTR("Baud rate not confirmed"));
+  }
 }
 
-void sp_millInfo()
+void sp_execute_realtime()
 {
-	printPgmString(PSTR("\r\nMezzoMill "));
-	printPgmString(PSTR(MM_VERSION));
-	print_newline();
+  uint8_t execute = sp_execute;
+  if (execute == 0) { return; }
+  if (execute & EXEC_RESET) {
+    st_reset();
+    return;
+  }
+  uint8_t sreg = SREG;
+  cli();
+  sp_execute &= ~execute;
+  SREG = sreg;
+  if (execute & EXEC_FEED_HOLD) { st_feed_hold(); }
+  if (execute & EXEC_CYCLE_START) { st_cycle_start(); }
+  if (execute & EXEC_STATUS_REPORT) { report_realtime_status(); }
+}
+
+// Soft reset: drops all motion and input and starts over as after power up. The position is lost.
+static void sp_reset()
+{
+  st_reset();
+  spindle_stop();
+  plan_init();
+  gc_init();
+  serialFlush();
+  sp_execute = 0;
+  report_build_info();
+}
+
+// Checks and executes the binary frame in line: FRAME_START, then the escaped length, payload and CRC
+static void sp_execute_frame(uint8_t line_length)
+{
+  uint8_t length = 0;
+  uint8_t i;
+  for (i = 1; i < line_length; i++) {
+    uint8_t c = line[i];
+    if ((c == FRAME_ESCAPE) && (i+1 < line_length)) { c = line[++i] ^ FRAME_ESCAPE_XOR; }
+    line[length++] = c;
+  }
+  uint8_t payload_length = line[0];
+  if ((length < 3) || (length != payload_length+3)) {
+    sp_acknowledge(GCSTATUS_BAD_FRAME);
+    return;
+  }
+  uint16_t crc = 0xffff;
+  for (i = 0; i <= payload_length; i++) { crc = _crc_ccitt_update(crc, line[i]); }
+  if (crc != (((uint8_t)line[payload_length+1] << 8) | (uint8_t)line[payload_length+2])) { 
+    sp_acknowledge(GCSTATUS_BAD_FRAME); 
+  } else {
+    sp_acknowledge(gc_execute_frame((uint8_t *)line+1, payload_length));
+  }
 }
 
 void sp_process()
 {
-  char c;
-  while((c = serialRead()) != -1) 
+  int length;
+  uint8_t status_code;
+  sp_execute_realtime();
+  // The receive interrupt has stripped, upcased and counted the lines already. A reset drops the lines
+  // still waiting, so stop at once.
+  while(!(sp_execute & EXEC_RESET) && (length = serialReadLine(line)) != -1) 
   {
-    if((char_counter > 0) && ((c == '\n') || (c == '\r'))) {  // Line is complete. Then execute!
-      line[char_counter] = 0; // treminate string
-	  printString(line); print_newline();
-      status_message(gc_execute_line(line));
-      char_counter = 0; // reset line buffer index
-    } else if (c <= ' ') { // Throw away whitepace and control characters
-    } else if (c >= 'a' && c <= 'z') { // Upcase lowercase
-      line[char_counter++] = c-'a'+'A';
+    if (line[0] == SERIAL_LINE_TOO_LONG) {
+      sp_acknowledge(GCSTATUS_LINE_TOO_LONG);
+    } else if (line[0] == FRAME_START) {
+      sp_execute_frame(length);
+    } else if (length == 0) {
+      sp_acknowledge(GCSTATUS_OK); // Only whitespace or comments
     } else {
-      line[char_counter++] = c;
+      report_echo_line(line);
+      status_code = gc_execute_line(line);
+      if (settings.baud_rate != serialBaudRate()) { 
+        sp_change_baud_rate();
+      } else {
+        sp_acknowledge(status_code);
+      }
     }
   }
+  if (sp_execute & EXEC_RESET) { sp_reset(); }
 }
@@ -20,14 +20,43 @@
 #ifndef serial_h
 #define serial_h
 
+#include <inttypes.h>
+
+// Real-time command characters. The receive interrupt picks them out of the serial stream before they reach 
+// the receive buffer and flags them in sp_execute.
+#define CMD_STATUS_REPORT '?'
+#define CMD_FEED_HOLD '!'
+#define CMD_CYCLE_START '~'
+#define CMD_RESET 0x18 // ctrl-x
+
+#define EXEC_STATUS_REPORT (1<<0)
+#define EXEC_FEED_HOLD     (1<<1)
+#define EXEC_CYCLE_START   (1<<2)
+#define EXEC_RESET         (1<<3)
+
+// Binary motion frames: FRAME_START, then the payload length, the payload (see gcode.h), its CRC-16
+// (CCITT, reflected, initial value 0xffff, high byte first) over the length and the payload, and a line end. 
+// Every byte in between that is a real-time command, a line end, FRAME_START or FRAME_ESCAPE itself is sent as 
+// FRAME_ESCAPE followed by the byte xor FRAME_ESCAPE_XOR. Each frame is acknowledged like a line, but not 
+// echoed. A damaged frame is answered with an error once and skipped up to its line end.
+#define FRAME_START 0x01
+#define FRAME_ESCAPE 0x1b
+#define FRAME_ESCAPE_XOR 0x40
+
+// The real-time commands waiting to be serviced
+extern volatile uint8_t sp_execute;
+
 // Initialize the serial protocol
 void sp_init();
 void sp_init_must_be_first();
 
-void sp_millInfo();
-
 // Read command lines from the serial port and execute them as they
 // come in. Blocks until the serial buffer is emptied. 
 void sp_process();
 
+// Services the real-time commands. Called from the main loop and from every loop that waits for the stepper.
+// A reset stops the steppers here, but the loops waiting on the stepper must give up so sp_process() can
+// finish it.
+void sp_execute_realtime();
+
 #endif
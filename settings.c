@@ -24,6 +24,7 @@
 #include "settings.h"
 #include "eeprom.h"
 #include "wiring_serial.h"
+#include "report.h"
 #include <avr/pgmspace.h>
 
 settings_t settings;
@@ -39,6 +40,84 @@ typedef struct {
   double mm_per_arc_segment;
 } settings_v1_t;
 
+// Version 2 outdated settings record
+typedef struct {
+  double steps_per_mm[3];
+  uint8_t microsteps;
+  uint8_t pulse_microseconds;
+  double default_feed_rate;
+  double default_seek_rate;
+  uint8_t invert_mask;
+  double mm_per_arc_segment;
+  double acceleration;
+  double max_jerk;
+} settings_v2_t;
+
+// Version 3 outdated settings record
+typedef struct {
+  double steps_per_mm[3];
+  uint8_t microsteps;
+  uint8_t pulse_microseconds;
+  double default_feed_rate;
+  double default_seek_rate;
+  uint8_t invert_mask;
+  double mm_per_arc_segment;
+  double acceleration;
+  double max_jerk;
+  double junction_deviation;
+} settings_v3_t;
+
+// Version 4 outdated settings record
+typedef struct {
+  double steps_per_mm[3];
+  uint8_t microsteps;
+  uint8_t pulse_microseconds;
+  double default_feed_rate;
+  double default_seek_rate;
+  uint8_t invert_mask;
+  double mm_per_arc_segment;
+  double acceleration;
+  double max_jerk;
+  double junction_deviation;
+  double max_acceleration[3];
+  double max_rate[3];
+} settings_v4_t;
+
+// Version 5 outdated settings record
+typedef struct {
+  double steps_per_mm[3];
+  uint8_t microsteps;
+  uint8_t pulse_microseconds;
+  double default_feed_rate;
+  double default_seek_rate;
+  uint8_t invert_mask;
+  double mm_per_arc_segment;
+  double acceleration;
+  double max_jerk;
+  double junction_deviation;
+  double max_acceleration[3];
+  double max_rate[3];
+  uint8_t verbosity;
+} settings_v5_t;
+
+// Version 6 outdated settings record
+typedef struct {
+  double steps_per_mm[3];
+  uint8_t microsteps;
+  uint8_t pulse_microseconds;
+  double default_feed_rate;
+  double default_seek_rate;
+  uint8_t invert_mask;
+  double mm_per_arc_segment;
+  double acceleration;
+  double max_jerk;
+  double junction_deviation;
+  double max_acceleration[3];
+  double max_rate[3];
+  uint8_t verbosity;
+  uint32_t baud_rate;
+} settings_v6_t;
+
 void settings_reset() {
   settings.steps_per_mm[X_AXIS] = DEFAULT_X_STEPS_PER_MM;
   settings.steps_per_mm[Y_AXIS] = DEFAULT_Y_STEPS_PER_MM;
@@ -50,27 +129,19 @@ void settings_reset() {
   settings.mm_per_arc_segment = DEFAULT_MM_PER_ARC_SEGMENT;
   settings.invert_mask = DEFAULT_STEPPING_INVERT_MASK;
   settings.max_jerk = DEFAULT_MAX_JERK;
+  settings.junction_deviation = DEFAULT_JUNCTION_DEVIATION;
+  settings.max_acceleration[X_AXIS] = DEFAULT_X_ACCELERATION;
+  settings.max_acceleration[Y_AXIS] = DEFAULT_Y_ACCELERATION;
+  settings.max_acceleration[Z_AXIS] = DEFAULT_Z_ACCELERATION;
+  settings.max_rate[X_AXIS] = DEFAULT_X_MAX_RATE;
+  settings.max_rate[Y_AXIS] = DEFAULT_Y_MAX_RATE;
+  settings.max_rate[Z_AXIS] = DEFAULT_Z_MAX_RATE;
+  settings.verbosity = DEFAULT_VERBOSITY;
+  settings.baud_rate = BAUD_RATE;
+  settings.arc_tolerance = DEFAULT_ARC_TOLERANCE;
 }
 
-void settings_dump() {
-  // MM_COMMENT - I added $10
-  printPgmString(PSTR("$10=0 (resets to defaut settings. Reboot for them to take effect.)\r\n"));
-  printPgmString(PSTR("$0 = ")); printFloat(settings.steps_per_mm[X_AXIS]);
-  printPgmString(PSTR(" (steps/mm x)\r\n$1 = ")); printFloat(settings.steps_per_mm[Y_AXIS]);
-  printPgmString(PSTR(" (steps/mm y)\r\n$2 = ")); printFloat(settings.steps_per_mm[Z_AXIS]);
-  printPgmString(PSTR(" (steps/mm z)\r\n$3 = ")); printInteger(settings.pulse_microseconds);
-  printPgmString(PSTR(" (microseconds step pulse)\r\n$4 = ")); printFloat(settings.default_feed_rate);
-  printPgmString(PSTR(" (mm/min default feed rate)\r\n$5 = ")); printFloat(settings.default_seek_rate);
-  printPgmString(PSTR(" (mm/min default seek rate)\r\n$6 = ")); printFloat(settings.mm_per_arc_segment);
-  printPgmString(PSTR(" (mm/arc segment)\r\n$7 = ")); printInteger(settings.invert_mask); 
-  printPgmString(PSTR(" (step port invert mask. binary = ")); printIntegerInBase(settings.invert_mask, 2);  
-  printPgmString(PSTR(")\r\n$8 = ")); printFloat(settings.acceleration);
-  printPgmString(PSTR(" (acceleration in mm/sec^2)\r\n$9 = ")); printFloat(settings.max_jerk);
-  printPgmString(PSTR(" (max instant cornering speed change in delta mm/min)"));
-  printPgmString(PSTR("\r\n'$x=value' to set parameter or just '$' to dump current settings\r\n"));
-}
-
-void write_settings() {
+void settings_write() {
   eeprom_put_char(0, SETTINGS_VERSION);
   memcpy_to_eeprom_with_checksum(1, (char*)&settings, sizeof(settings_t));
 }
@@ -84,13 +155,43 @@ int read_settings() {
     if (!(memcpy_from_eeprom_with_checksum((char*)&settings, 1, sizeof(settings_t)))) {
       return(FALSE);
     }
-  } else if (version == 1) {
-    // Migrate from old settings version
-    if (!(memcpy_from_eeprom_with_checksum((char*)&settings, 1, sizeof(settings_v1_t)))) {
+  } else if ((version >= 1) && (version < SETTINGS_VERSION)) {
+    // Migrate from old settings version. Each version only appended to the record of the one before, 
+    // so read the old record and fill in what was added since.
+    uint8_t size = sizeof(settings_v6_t);
+    if (version == 5) { size = sizeof(settings_v5_t); }
+    if (version == 4) { size = sizeof(settings_v4_t); }
+    if (version == 3) { size = sizeof(settings_v3_t); }
+    if (version == 1) { size = sizeof(settings_v1_t); }
+    if (version == 2) { size = sizeof(settings_v2_t); }
+    if (!(memcpy_from_eeprom_with_checksum((char*)&settings, 1, size))) {
       return(FALSE);
     }
-    settings.acceleration = DEFAULT_ACCELERATION;
-    settings.max_jerk = DEFAULT_MAX_JERK;
+    if (version < 2) {
+      settings.acceleration = DEFAULT_ACCELERATION;
+      settings.max_jerk = DEFAULT_MAX_JERK;
+    }
+    if (version < 3) {
+      settings.junction_deviation = DEFAULT_JUNCTION_DEVIATION;
+    }
+    if (version < 4) {
+      // Keep moving as before: every axis may use the acceleration that used to be global
+      settings.max_acceleration[X_AXIS] = settings.acceleration;
+      settings.max_acceleration[Y_AXIS] = settings.acceleration;
+      settings.max_acceleration[Z_AXIS] = settings.acceleration;
+      settings.max_rate[X_AXIS] = DEFAULT_X_MAX_RATE;
+      settings.max_rate[Y_AXIS] = DEFAULT_Y_MAX_RATE;
+      settings.max_rate[Z_AXIS] = DEFAULT_Z_MAX_RATE;
+    }
+    if (version < 5) {
+      settings.verbosity = DEFAULT_VERBOSITY;
+    }
+    if (version < 6) {
+      settings.baud_rate = BAUD_RATE;
+    }
+    if (version < 7) {
+      settings.arc_tolerance = DEFAULT_ARC_TOLERANCE;
+    }
   } else {      
     return(FALSE);
   }
@@ -98,7 +199,7 @@ int read_settings() {
 }
 
 // A helper method to set settings from command line
-void settings_store_setting(int parameter, double value) {
+uint8_t settings_store_setting(int parameter, double value) {
   switch(parameter) {
     case 0: case 1: case 2:
     settings.steps_per_mm[parameter] = value; break;
@@ -109,23 +210,42 @@ void settings_store_setting(int parameter, double value) {
     case 7: settings.invert_mask = trunc(value); break;
     case 8: settings.acceleration = value; break;
     case 9: settings.max_jerk = fabs(value); break;
-	  case 10: settings_reset(); break;
+	  case 10: {
+	    // Only $19 changes the baud rate, once the host has confirmed it at the new rate
+	    uint32_t baud_rate = settings.baud_rate;
+	    settings_reset(); 
+	    settings.baud_rate = baud_rate;
+	    break;
+	  }
+    case 11: settings.junction_deviation = fabs(value); break;
+    case 12: case 13: case 14:
+    // The planner divides by the axis acceleration and rate, so they must be positive
+    if (!(value > 0)) { return(FALSE); }
+    settings.max_acceleration[parameter-12] = value; break;
+    case 15: case 16: case 17:
+    if (!(value > 0)) { return(FALSE); }
+    settings.max_rate[parameter-15] = value; break;
+    case 18: settings.verbosity = min(fabs(trunc(value)), VERBOSITY_VERBOSE); break;
+    case 19: 
+    if (!serialBaudRateUsable(value)) { return(FALSE); }
+    // Stored once the host confirms the new rate (see sp_change_baud_rate)
+    settings.baud_rate = value; 
+    return(TRUE);
+    case 20: settings.arc_tolerance = fabs(value); break;
     default: 
-      printPgmString(PSTR("Unknown parameter\r\n"));
-      return;
+      return(FALSE);
   }
-  write_settings();
-  printPgmString(PSTR("Stored new setting\r\n"));
+  settings_write();
+  report_feedback_message(PSTR("Stored new setting"));
+  return(TRUE);
 }
 
 // Initialize the config subsystem
 void settings_init() {
-  if(read_settings()) {
-    printPgmString(PSTR("'$' to dump current settings\r\n"));
-  } else {
-    printPgmString(PSTR("Warning: Failed to read EEPROM settings. Using defaults.\r\n"));
+  if(!read_settings()) {
     settings_reset();
-    write_settings();
-    settings_dump();
+    report_alarm_message(PSTR("Warning: Failed to read EEPROM settings. Using defaults."));
+    settings_write();
+    report_settings();
   }
 }
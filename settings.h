@@ -22,6 +22,7 @@
 #define settings_h
 
 #include "config.h"
+#include "report.h"
 #include <math.h>
 #include <inttypes.h>
 
@@ -29,7 +30,7 @@
 
 // Version of the EEPROM data. Will be used to migrate existing data from older versions of Grbl
 // when firmware is upgraded. Always stored in byte 0 of eeprom
-#define SETTINGS_VERSION 2
+#define SETTINGS_VERSION 7
 
 // Current global settings (persisted in EEPROM from byte 1 onwards)
 typedef struct {
@@ -42,17 +43,23 @@ typedef struct {
   double mm_per_arc_segment;
   double acceleration;
   double max_jerk;
+  double junction_deviation;
+  double max_acceleration[3];   // Per axis, mm/sec^2
+  double max_rate[3];           // Per axis, mm/min
+  uint8_t verbosity;            // VERBOSITY_QUIET, _TERSE or _VERBOSE (see report.h)
+  uint32_t baud_rate;
+  double arc_tolerance;         // mm the arc segments may stray from the circle, 0 = use mm_per_arc_segment
 } settings_t;
 extern settings_t settings;
 
 // Initialize the configuration subsystem (load settings from EEPROM)
 void settings_init();
 
-// Print current settings
-void settings_dump();
+// Writes the settings to EEPROM
+void settings_write();
 
-// A helper method to set new settings from command line
-void settings_store_setting(int parameter, double value);
+// A helper method to set new settings from command line. Returns FALSE for an unknown parameter.
+uint8_t settings_store_setting(int parameter, double value);
 
 // Default settings (used when resetting eeprom-settings)
 //#define MICROSTEPS 8
@@ -61,10 +68,13 @@ void settings_store_setting(int parameter, double value);
 //#define DEFAULT_Z_STEPS_PER_MM (94.488188976378*MICROSTEPS)
 //#define DEFAULT_STEP_PULSE_MICROSECONDS 30
 #define DEFAULT_MM_PER_ARC_SEGMENT 0.1
+#define DEFAULT_ARC_TOLERANCE 0.005 // mm
 //#define DEFAULT_RAPID_FEEDRATE 480.0 // in millimeters per minute
 //#define DEFAULT_FEEDRATE 480.0
 //#define DEFAULT_ACCELERATION (DEFAULT_FEEDRATE/100.0)
 #define DEFAULT_MAX_JERK 50.0
+#define DEFAULT_JUNCTION_DEVIATION 0.05 // mm
+#define DEFAULT_VERBOSITY VERBOSITY_VERBOSE
 //#define DEFAULT_STEPPING_INVERT_MASK 0
 
 #endif
@@ -37,22 +37,30 @@ void spindle_init()
   SPINDLE_ENABLE_DDR |= 1<<SPINDLE_ENABLE_BIT;
 }
 
+void spindle_set(int direction)
+{
+  if (direction) {
+    SPINDLE_ENABLE_PORT |= 1<<SPINDLE_ENABLE_BIT;
+    spindleEnabled = 1;
+  } else {
+    SPINDLE_ENABLE_PORT &= ~(1<<SPINDLE_ENABLE_BIT);
+    spindleEnabled = 0;
+    spindleSpeed = 0;
+  }
+  spindleDirection = direction;
+}
+
 void spindle_run(int direction, uint32_t rpm) 
 {
-  SPINDLE_ENABLE_PORT |= 1<<SPINDLE_ENABLE_BIT;
-  spindleEnabled = 1;
+  spindle_set(direction);
   spindleSpeed = rpm;
-  spindleDirection = direction;
   // wait a second for the spindle to spin up.
   _delay_ms(MOTOR_SPIN_UP_AND_DOWN_TIME);
 }
 
 void spindle_stop()
 {
-  SPINDLE_ENABLE_PORT &= ~(1<<SPINDLE_ENABLE_BIT);
-  spindleEnabled = 0;
-  spindleSpeed = 0;
-  spindleDirection = 0;
+  spindle_set(0);
   // wait a second for the spindle to spin down.
   _delay_ms(MOTOR_SPIN_UP_AND_DOWN_TIME);
 }
@@ -25,6 +25,9 @@
 
 void spindle_init();
 void spindle_run(int direction, uint32_t rpm);
+// Switches the spindle on in the given direction, or off for 0, without waiting for it. For the stepper 
+// interrupt, which runs the queued spindle commands.
+void spindle_set(int direction);
 void spindle_stop();
 void spindle_pause();
 void spindle_resume();
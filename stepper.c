@@ -30,9 +30,11 @@
 #include "nuts_bolts.h"
 #include <avr/interrupt.h>
 #include "planner.h"
+#include "spindle_control.h"
 #include "wiring_serial.h"
 
 #include "serial_protocol.h"
+#include "report.h"
 #include <avr/pgmspace.h>
 
 // Some useful constants
@@ -42,28 +44,103 @@
 #define LIMIT_MASK ((1<<X_LIMIT_BIT)|(1<<Y_LIMIT_BIT)|(1<<Z_LIMIT_BIT)) // All limit bits
 
 #define TICKS_PER_MICROSECOND (F_CPU/1000000)
-#define CYCLES_PER_ACCELERATION_TICK ((TICKS_PER_MICROSECOND*1000000)/ACCELERATION_TICKS_PER_SECOND)
 
 #define MINIMUM_STEPS_PER_MINUTE 1200 // The stepper subsystem will never run slower than this, exept when sleeping
 
 #define ENABLE_STEPPER_DRIVER_INTERRUPT()  TIMSK1 |= (1<<OCIE1A)
 #define DISABLE_STEPPER_DRIVER_INTERRUPT() TIMSK1 &= ~(1<<OCIE1A)
 
+// Adaptive multi-axis step smoothing: below AMASS_LEVEL1_RATE the interrupt runs at 2^level times the step
+// rate and the bresenham tracer at the same resolution, so the minor axes step evenly in between the steps 
+// of the major axis. Each halving of the rate adds a level, up to MAX_AMASS_LEVEL. The interrupt frequency 
+// stays below 2*AMASS_LEVEL1_RATE.
+#ifdef ADAPTIVE_MULTI_AXIS_STEP_SMOOTHING
+#define MAX_AMASS_LEVEL 3
+#else
+#define MAX_AMASS_LEVEL 0
+#endif
+#define AMASS_LEVEL1_RATE (8000L*60) // step_events/minute
+
+// Multi-stepping: from MULTI_STEP_RATE up the interrupt traces 2^level step events per interrupt, up to
+// MAX_MULTI_STEP_LEVEL, and timer 2 spaces out the pulses after the first
+#ifdef MULTI_STEP_RATE
+#define MAX_MULTI_STEP_LEVEL 2
+#else
+#define MAX_MULTI_STEP_LEVEL 0
+#endif
+
+// A segment is one phase of a block's trapezoid, acceleration, cruise or deceleration, within one smoothing 
+// or multi-stepping level. The main loop prepares them with st_prep_buffer(). The interrupt traces the line and moves the step
+// interval along the ramp, one step at a time.
+typedef struct {
+  block_t *block;         // The block the steps belong to. Segments never span blocks
+  uint16_t n_step;        // The number of step events left in this segment
+  uint8_t end_of_block;   // TRUE on the last segment of the block
+  uint8_t ramp;           // RAMP_ACCELERATE, RAMP_CRUISE or RAMP_DECELERATE
+  uint8_t amass_level;    // The step smoothing level. The interrupt runs 2^amass_level times per step event
+  uint8_t multi_step_level; // The multi-stepping level. The interrupt traces 2^multi_step_level step events
+  uint32_t ramp_step;     // The index of the current step on a ramp starting from (or ending at) standstill
+  uint32_t interval;      // The current step interval in 1/256 cycles
+  uint32_t interval_limit; // The shortest interval when accelerating, the longest when decelerating
+  uint16_t ceiling;       // The timer 1 ceiling (OCR1A) for the first smoothing tick, staged by st_prep_buffer()
+  uint8_t prescaler;      // The timer 1 clock select bits for the first smoothing tick
+  uint8_t pulse_spacing;  // The first step interval in timer 2 ticks, for spacing multi-step pulses
+} segment_t;
+
+#define RAMP_CRUISE 0
+#define RAMP_ACCELERATE 1
+#define RAMP_DECELERATE 2
+
+#define INTERVAL_FRACTION_BITS 8
+
+static segment_t segment_buffer[SEGMENT_BUFFER_SIZE]; // A ring buffer of prepared segments
+static volatile uint8_t segment_buffer_head;          // Index of the next segment to be pushed
+static volatile uint8_t segment_buffer_tail;          // Index of the segment to execute now
+
 static block_t *current_block;  // A pointer to the block currently being traced
+static segment_t *current_segment; // A pointer to the segment currently being executed
 
 // Variables used by The Stepper Driver Interrupt
 static uint8_t out_bits;        // The next stepping-bits to be output
 static int32_t counter_x,       // Counter variables for the bresenham line tracer
                counter_y, 
                counter_z;       
-static uint32_t step_events_completed; // The number of step events executed in the current block
+static uint32_t event_count;    // The step_event_count of the current block at the finest smoothing level
+static uint32_t steps_x,        // The steps of the current block at the smoothing level of the current segment
+                steps_y, 
+                steps_z;       
+static uint8_t amass_ticks;     // The interrupts left until the current step event is complete
+static uint8_t pulse_bits[1<<MAX_MULTI_STEP_LEVEL]; // The stepping-bits to output after out_bits in the next interrupt
+static uint8_t pulse_count;     // The number of entries in pulse_bits
+static uint16_t next_ceiling;   // The timer values for the interrupt that outputs out_bits and pulse_bits
+static uint8_t next_prescaler;
+static uint8_t next_pulse_spacing;
+static uint8_t ramp_events;     // The step events traced in the last interrupt, for moving along the ramp
+static uint8_t stepping;        // TRUE when the last interrupt traced steps
+static int32_t position[3];     // The machine position in steps, counted as the steps are traced
+
+// Variables shared with the timer 2 interrupts, which output the extra pulses of a multi-step interrupt
+static volatile uint8_t pulse_queue[1<<MAX_MULTI_STEP_LEVEL]; // The pulses still to output
+static volatile uint8_t pulse_queue_index; // The next pulse to output
+static volatile uint8_t pulses_queued;     // The number of pulses still to output
+static volatile uint8_t pulse_spacing;     // The step interval of the queued pulses in timer 2 ticks
+static volatile uint8_t direction_pending; // TRUE when next_direction_bits must be set once the queued pulses are done
+static volatile uint8_t next_direction_bits; 
 static volatile int busy; // TRUE when SIG_OUTPUT_COMPARE1A is being serviced. Used to avoid retriggering that handler.
 
-// Variables used by the trapezoid generation
-static uint32_t cycles_per_step_event;        // The number of machine cycles between each step event
-static uint32_t trapezoid_tick_cycle_counter; // The cycles since last trapezoid_tick. Used to generate ticks at a steady
-                                              // pace without allocating a separate timer
-static uint32_t trapezoid_adjusted_rate;      // The current rate of step_events according to the trapezoid generator
+// Feed hold: the interrupt slows the steps down along its own deceleration ramp, whatever the segments plan,
+// until it stops. Cycle start accelerates along the same ramp until it catches up with the plan.
+#define HOLD_OFF 0
+#define HOLD_DECELERATE 1
+#define HOLD_STOPPED 2
+#define HOLD_ACCELERATE 3
+static volatile uint8_t hold_state;
+static uint32_t hold_interval;  // The step interval on the hold ramp in 1/256 cycles
+static uint32_t hold_ramp_step; // The index of the step on the hold ramp. 0 when held at standstill
+
+// Variables used by the trapezoid generation in st_prep_buffer()
+static block_t *prep_block;                   // The block segments are being prepared from
+static uint16_t prep_step_events;             // The step events of prep_block already put in segments
 
 //         __________________________
 //        /|                        |\     _________________         ^
@@ -76,132 +153,382 @@ static uint32_t trapezoid_adjusted_rate;      // The current rate of step_events
 //
 //                           time ----->
 // 
-//  The trapezoid is the shape the speed curve over time. It starts at block->initial_rate, accelerates by block->rate_delta
-//  during the first block->accelerate_until step_events_completed, then keeps going at constant speed until 
-//  step_events_completed reaches block->decelerate_after after which it decelerates until the trapezoid generator is reset.
-//  The slope of acceleration is always +/- block->rate_delta and is applied at a constant rate by trapezoid_generator_tick()
-//  that is called ACCELERATION_TICKS_PER_SECOND times per second.
+//  The trapezoid is the shape the speed curve over time. It starts at block->initial_rate, accelerates at
+//  block->acceleration during the first block->accelerate_until step_events_completed, then keeps going at constant
+//  speed until step_events_completed reaches block->decelerate_after after which it decelerates to block->final_rate.
+//  Each phase is one or more segments. The interval between two steps on a ramp follows the recursive approximation 
+//  from Atmel's AVR446 application note. Step n of an acceleration from standstill comes 
+//
+//    interval(n) = interval(n-1) - 2*interval(n-1)/(4n+1)
+//
+//  after the previous one. A ramp starting at the rate r enters this sequence at n = r^2/(2*acceleration). 
+//  Decelerating walks n back down.
 
-void set_step_events_per_minute(uint32_t steps_per_minute);
+uint32_t config_step_timer(uint32_t cycles, uint16_t *ceiling, uint8_t *prescaler);
 
 void st_wake_up() {
-  ENABLE_STEPPER_DRIVER_INTERRUPT();  
+  if (sp_execute & EXEC_RESET) { return; } // The blocks are stale, the plan is about to be reset
+  st_prep_buffer();
 }
 
-// Initializes the trapezoid generator from the current block. Called whenever a new 
-// block begins.
-inline void trapezoid_generator_reset() {
-  trapezoid_adjusted_rate = current_block->initial_rate;  
-  trapezoid_tick_cycle_counter = 0; // Always start a new trapezoid with a full acceleration tick
-  set_step_events_per_minute(trapezoid_adjusted_rate);
+// Returns the step interval for the given rate in 1/256 cycles
+static uint32_t interval_for_rate(uint32_t steps_per_minute) {
+  if (steps_per_minute < MINIMUM_STEPS_PER_MINUTE) { steps_per_minute = MINIMUM_STEPS_PER_MINUTE; }
+  return(((TICKS_PER_MICROSECOND*1000000*60)/steps_per_minute) << INTERVAL_FRACTION_BITS);
 }
 
-// This is called ACCELERATION_TICKS_PER_SECOND times per second by the step_event
-// interrupt. It can be assumed that the trapezoid-generator-parameters and the
-// current_block stays untouched by outside handlers for the duration of this function call.
-inline void trapezoid_generator_tick() {     
-  if (current_block) {
-    if (step_events_completed < current_block->accelerate_until) {
-      trapezoid_adjusted_rate += current_block->rate_delta;
-      if (trapezoid_adjusted_rate > current_block->nominal_rate ) {
-        trapezoid_adjusted_rate = current_block->nominal_rate;
-      }
-      set_step_events_per_minute(trapezoid_adjusted_rate);
-    } else if (step_events_completed > current_block->decelerate_after) {
-      // NOTE: We will only reduce speed if the result will be > 0. This catches small
-      // rounding errors that might leave steps hanging after the last trapezoid tick.
-      if (trapezoid_adjusted_rate > current_block->rate_delta) {
-        trapezoid_adjusted_rate -= current_block->rate_delta;
+// Returns the index of the step on an acceleration ramp from standstill at which prep_block reaches the 
+// given rate
+static uint32_t ramp_step_for_rate(uint32_t steps_per_minute) {
+  if (steps_per_minute < MINIMUM_STEPS_PER_MINUTE) { steps_per_minute = MINIMUM_STEPS_PER_MINUTE; }
+  return(lround((double)steps_per_minute*steps_per_minute/(2.0*prep_block->acceleration)));
+}
+
+// Returns the rate prep_block reaches at the given step of an acceleration ramp from standstill
+static uint32_t rate_for_ramp_step(uint32_t ramp_step) {
+  return(lround(sqrt(2.0*prep_block->acceleration*ramp_step)));
+}
+
+// Sets the step smoothing and multi-stepping levels of the segment for the given rate. Returns the rates at 
+// which the segment leaves those levels, or 0 if there is no slower or faster level.
+static void set_step_levels(segment_t *segment, uint32_t rate, uint32_t *lower_rate, uint32_t *upper_rate) {
+  uint8_t level = 0;
+  *lower_rate = 0;
+  *upper_rate = 0;
+  while (level < MAX_AMASS_LEVEL && rate < (AMASS_LEVEL1_RATE >> level)) { 
+    *upper_rate = AMASS_LEVEL1_RATE >> level;
+    level++;
+  }
+  if (level < MAX_AMASS_LEVEL) { *lower_rate = AMASS_LEVEL1_RATE >> level; }
+  segment->amass_level = level;
+  level = 0;
+#ifdef MULTI_STEP_RATE
+  if (segment->amass_level == 0) {
+    while (level < MAX_MULTI_STEP_LEVEL && rate >= (MULTI_STEP_RATE << level)) {
+      *lower_rate = MULTI_STEP_RATE << level;
+      level++;
+    }
+    if (level < MAX_MULTI_STEP_LEVEL) { *upper_rate = MULTI_STEP_RATE << level; }
+  }
+#endif
+  segment->multi_step_level = level;
+}
+
+// Returns the timer 1 cycles per interrupt for the current interval of the segment
+static inline uint32_t timer_cycles(segment_t *segment) {
+  return((segment->interval >> (INTERVAL_FRACTION_BITS+segment->amass_level)) << segment->multi_step_level);
+}
+
+// Returns the step interval in timer 2 ticks
+static inline uint8_t timer2_ticks(uint32_t interval) {
+  uint32_t ticks = interval >> (INTERVAL_FRACTION_BITS+3);
+  if (ticks > 0xff) { return(0xff); }
+  return(ticks);
+}
+
+// Fills the segment buffer from the planned blocks. All the trapezoid math happens here in the main loop.
+// Must be called often enough that the buffer never runs dry while moving: the loops that wait on the 
+// stepper call it before going to sleep. Wakes the stepper interrupt if it ran out.
+void st_prep_buffer()
+{
+  // After st_reset() the planner still holds the old blocks until the soft reset clears them. Cut nothing
+  // from them.
+  if (sp_execute & EXEC_RESET) { return; }
+  uint8_t next_head = segment_buffer_head + 1;
+  if (next_head == SEGMENT_BUFFER_SIZE) { next_head = 0; }
+  while (next_head != segment_buffer_tail) {
+    if (prep_block == NULL) {
+      prep_block = plan_get_next_prep_block();
+      if (prep_block == NULL) { break; }
+      prep_step_events = 0;
+    }
+    
+    segment_t *segment = &segment_buffer[segment_buffer_head];
+    segment->block = prep_block;
+    uint16_t accelerate_until = prep_block->accelerate_until;
+    uint16_t decelerate_after = max(prep_block->decelerate_after, accelerate_until);
+    uint32_t rate;
+    uint32_t lower_rate, upper_rate;
+    if (prep_step_events < accelerate_until) {
+      segment->ramp = RAMP_ACCELERATE;
+      segment->n_step = accelerate_until-prep_step_events;
+      segment->ramp_step = ramp_step_for_rate(prep_block->initial_rate)+prep_step_events;
+      rate = prep_block->initial_rate;
+      if (prep_step_events) { rate = min(rate_for_ramp_step(segment->ramp_step), prep_block->nominal_rate); }
+      segment->interval_limit = interval_for_rate(prep_block->nominal_rate);
+      // End the segment where the rate enters the next faster level
+      set_step_levels(segment, rate, &lower_rate, &upper_rate);
+      if (upper_rate) { 
+        uint32_t band_limit_step = ramp_step_for_rate(upper_rate);
+        if (band_limit_step > segment->ramp_step) { 
+          segment->n_step = min(segment->n_step, band_limit_step-segment->ramp_step);
+        }
       }
-      if (trapezoid_adjusted_rate < current_block->final_rate) {
-        trapezoid_adjusted_rate = current_block->final_rate;
-      }        
-      set_step_events_per_minute(trapezoid_adjusted_rate);
+    } else if (prep_step_events < decelerate_after) {
+      segment->ramp = RAMP_CRUISE;
+      segment->n_step = decelerate_after-prep_step_events;
+      rate = prep_block->nominal_rate;
+      set_step_levels(segment, rate, &lower_rate, &upper_rate);
     } else {
-      // Make sure we cruise at exactly nominal rate
-      if (trapezoid_adjusted_rate != current_block->nominal_rate) {
-        trapezoid_adjusted_rate = current_block->nominal_rate;
-        set_step_events_per_minute(trapezoid_adjusted_rate);
+      segment->ramp = RAMP_DECELERATE;
+      segment->n_step = prep_block->step_event_count-prep_step_events;
+      // Start from nominal rate, or from where the acceleration ended if it never got there
+      segment->ramp_step = min(ramp_step_for_rate(prep_block->nominal_rate), 
+        ramp_step_for_rate(prep_block->initial_rate)+accelerate_until);
+      segment->ramp_step -= min(segment->ramp_step, prep_step_events-decelerate_after);
+      rate = min(rate_for_ramp_step(segment->ramp_step), prep_block->nominal_rate);
+      segment->interval_limit = interval_for_rate(prep_block->final_rate);
+      // End the segment where the rate enters the next slower level
+      set_step_levels(segment, rate, &lower_rate, &upper_rate);
+      if (lower_rate) {
+        uint32_t band_limit_step = ramp_step_for_rate(lower_rate);
+        if (band_limit_step < segment->ramp_step) {
+          segment->n_step = min(segment->n_step, segment->ramp_step-band_limit_step);
+        }
       }
     }
+    segment->interval = interval_for_rate(rate);
+    // Stage the timers so starting the segment only takes a few register writes
+    config_step_timer(timer_cycles(segment), &segment->ceiling, &segment->prescaler);
+    segment->pulse_spacing = timer2_ticks(segment->interval);
+    
+    // Publish the segment
+    prep_step_events += segment->n_step;
+    segment->end_of_block = (prep_step_events == prep_block->step_event_count);
+    if (segment->end_of_block) { prep_block = NULL; }
+    segment_buffer_head = next_head;
+    if (++next_head == SEGMENT_BUFFER_SIZE) { next_head = 0; }
+  }
+  if (segment_buffer_head != segment_buffer_tail && hold_state != HOLD_STOPPED) {
+    ENABLE_STEPPER_DRIVER_INTERRUPT();  
+  }
+}
+
+// Moves the interval the given number of steps along an acceleration or deceleration ramp and returns it. For 
+// more than one step this extends the AVR446 recursion to interval(n) = interval(n-k) - 2k*interval(n-k)/(4n-2k+3),
+// which agrees with the exact ramp to the same order.
+static inline uint32_t ramp_interval(uint32_t interval, uint32_t *ramp_step, uint8_t ramp, uint8_t steps) {
+  uint32_t numerator = (interval << 1)*steps;
+  if (ramp == RAMP_ACCELERATE) {
+    *ramp_step += steps;
+    return(interval - numerator/((*ramp_step << 2)-(steps << 1)+3));
+  }
+  if (*ramp_step > steps) { 
+    *ramp_step -= steps; 
+  } else {
+    *ramp_step = 1;
+  }
+  return(interval + numerator/((*ramp_step << 2)+(steps << 1)-3));
+}
+
+// Moves the interval of the current segment the given number of steps along its ramp
+static inline void ramp_step(uint8_t steps) {
+  uint32_t interval = ramp_interval(current_segment->interval, &current_segment->ramp_step, current_segment->ramp, 
+    steps);
+  if (current_segment->ramp == RAMP_ACCELERATE) {
+    if (interval < current_segment->interval_limit) { interval = current_segment->interval_limit; }
+  } else {
+    if (interval > current_segment->interval_limit) { interval = current_segment->interval_limit; }
+  }
+  current_segment->interval = interval;
+}
+
+// Moves the feed hold ramp the given number of steps. Stops where the next steps would pass standstill and 
+// ends the hold once it catches up with the current segment.
+static inline void hold_step(uint8_t steps) {
+  if (hold_state == HOLD_DECELERATE) {
+    if (hold_ramp_step <= steps) { 
+      hold_state = HOLD_STOPPED; 
+    } else {
+      hold_interval = ramp_interval(hold_interval, &hold_ramp_step, RAMP_DECELERATE, steps);
+    }
+  } else {
+    hold_interval = ramp_interval(hold_interval, &hold_ramp_step, RAMP_ACCELERATE, steps);
+    if (current_segment != NULL && hold_interval <= current_segment->interval) { hold_state = HOLD_OFF; }
   }
 }
 
+// Stages the timer values for the steps just traced from the segment, to be applied when they are output. 
+// Iterations is the number of step events (or smoothing ticks) traced. A feed hold slows them down further.
+static inline void stage_step_timer(segment_t *segment, uint8_t iterations) {
+  uint32_t interval = segment->interval;
+  if (hold_state != HOLD_OFF && hold_interval > interval) { interval = hold_interval; }
+  config_step_timer((interval >> (INTERVAL_FRACTION_BITS+segment->amass_level))*iterations, 
+    &next_ceiling, &next_prescaler);
+  next_pulse_spacing = timer2_ticks(interval);
+}
+
+// Sets timer 1 and the pulse spacing to the staged values
+static inline void set_step_timer() {
+  TCCR1B = (TCCR1B & ~(0x07<<CS10)) | next_prescaler;
+  OCR1A = next_ceiling;
+  pulse_spacing = next_pulse_spacing;
+}
+
+// Outputs the stepping-bits and starts the countdown of timer 2 so that The Stepper Port Reset Interrupt 
+// can reset the signal after exactly settings.pulse_microseconds microseconds. Clears the overflow flag 
+// to stop a queued interrupt from resetting the step pulse too soon. Settings below 3 microseconds give 
+// 1 microsecond pulses instead of wrapping around. Call with interrupts disabled.
+static inline void start_step_pulse(uint8_t bits) {
+  STEPPING_PORT = (STEPPING_PORT & ~STEP_MASK) | bits;
+  TCNT2 = -(((max(settings.pulse_microseconds, 3)-2)*TICKS_PER_MICROSECOND)/8);
+  TIFR2 |= (1<<TOV2);
+}
+
 // "The Stepper Driver Interrupt" - This timer interrupt is the workhorse of Grbl. It is  executed at the rate set with
-// config_step_timer. It pops blocks from the block_buffer and executes them by pulsing the stepper pins appropriately. 
+// set_step_timer. It pops segments from the segment_buffer and executes them by pulsing the stepper pins appropriately. 
 // It is supported by The Stepper Port Reset Interrupt which it uses to reset the stepper port after each pulse.
 SIGNAL(TIMER1_COMPA_vect)
 {        
   // TODO: Check if the busy-flag can be eliminated by just disabeling this interrupt while we are in it
   
   if(busy){ return; } // The busy-flag is used to avoid reentering this interrupt
-  // Set the direction pins a cuple of nanoseconds before we step the steppers
-  STEPPING_PORT = (STEPPING_PORT & ~DIRECTION_MASK) | (out_bits & DIRECTION_MASK);
-  // Then pulse the stepping pins
-  STEPPING_PORT = (STEPPING_PORT & ~STEP_MASK) | out_bits;
-  // Reset step pulse reset timer so that The Stepper Port Reset Interrupt can reset the signal after
-  // exactly settings.pulse_microseconds microseconds.  Clear the overflow flag to stop a queued
-  // interrupt from resetting the step pulse too soon.
-  TCNT2 = -(((settings.pulse_microseconds-2)*TICKS_PER_MICROSECOND)/8);
-  TIFR2 |= (1<<TOV2);
+  // The direction pins were normally set for these steps at the end of the last interrupt
+  if (direction_pending) { 
+    STEPPING_PORT = (STEPPING_PORT & ~DIRECTION_MASK) | next_direction_bits;
+    direction_pending = FALSE;
+  }
+  // Pulse the stepping pins
+  start_step_pulse(out_bits);
+  // Time this interrupt by the steps just output. They were traced one interrupt ahead, possibly from the 
+  // segment before the current one.
+  set_step_timer();
+  // Hand the remaining steps of this interrupt to timer 2, one step interval apart
+  if (pulse_count) {
+    uint8_t i;
+    for (i = 0; i < pulse_count; i++) { pulse_queue[i] = pulse_bits[i]; }
+    pulse_queue_index = 0;
+    pulses_queued = pulse_count;
+    OCR2A = TCNT2+pulse_spacing;
+    TIFR2 |= (1<<OCF2A);
+    TIMSK2 |= (1<<OCIE2A);
+  }
 
   busy = TRUE;
   sei(); // Re enable interrupts (normally disabled while inside an interrupt handler)
          // ((We re-enable interrupts in order for SIG_OVERFLOW2 to be able to be triggered 
          // at exactly the right time even if we occasionally spend a lot of time inside this handler.))
     
-  // If there is no current block, attempt to pop one from the buffer
-  if (current_block == NULL) {
-    // Anything in the buffer?
-    current_block = plan_get_current_block();
-    if (current_block != NULL) {
-      trapezoid_generator_reset();
-      counter_x = -(current_block->step_event_count >> 1);
-      counter_y = counter_x;
-      counter_z = counter_x;
-      step_events_completed = 0;
+  uint8_t was_stepping = stepping;
+  uint8_t restage = FALSE;
+  // Move along the feed hold ramp by the step events traced last time
+  if (ramp_events && (hold_state == HOLD_DECELERATE || hold_state == HOLD_ACCELERATE)) { 
+    hold_step(ramp_events);
+    restage = TRUE;
+  }
+  if (hold_state == HOLD_STOPPED) {
+    // Held still. The current segment goes on from here after cycle start
+    DISABLE_STEPPER_DRIVER_INTERRUPT();
+  } else if (current_segment == NULL) {
+    // If there is no current segment, attempt to pop one from the buffer
+    if (segment_buffer_head != segment_buffer_tail) {
+      current_segment = &segment_buffer[segment_buffer_tail];
+      next_ceiling = current_segment->ceiling;
+      next_prescaler = current_segment->prescaler;
+      next_pulse_spacing = current_segment->pulse_spacing;
+      if (current_block == NULL) {
+        current_block = current_segment->block;
+        // A spindle command switches the spindle as its wait starts
+        if (current_block->type == BLOCK_SPINDLE_RUN) { 
+          spindle_set(1); 
+        } else if (current_block->type == BLOCK_SPINDLE_STOP) {
+          spindle_set(0);
+        }
+        event_count = (uint32_t)current_block->step_event_count << MAX_AMASS_LEVEL;
+        counter_x = -(event_count >> 1);
+        counter_y = counter_x;
+        counter_z = counter_x;
+      }
+      // Trace the line at the resolution of this segment's smoothing level 
+      uint8_t shift = MAX_AMASS_LEVEL-current_segment->amass_level;
+      steps_x = (uint32_t)current_block->steps_x << shift;
+      steps_y = (uint32_t)current_block->steps_y << shift;
+      steps_z = (uint32_t)current_block->steps_z << shift;
+      amass_ticks = 1 << current_segment->amass_level;
     } else {
+      // Out of steps. A feed hold is as good as done, and the next motion starts from standstill anyway
+      if (hold_state == HOLD_DECELERATE) { 
+        hold_ramp_step = 0;
+        hold_state = HOLD_STOPPED; 
+      } else if (hold_state == HOLD_ACCELERATE) {
+        hold_state = HOLD_OFF;
+      }
       DISABLE_STEPPER_DRIVER_INTERRUPT();
     }    
-  } 
-
-  if (current_block != NULL) {
-    out_bits = current_block->direction_bits;
-    counter_x += current_block->steps_x;
-    if (counter_x > 0) {
-      out_bits |= (1<<X_STEP_BIT);
-      counter_x -= current_block->step_event_count;
-    }
-    counter_y += current_block->steps_y;
-    if (counter_y > 0) {
-      out_bits |= (1<<Y_STEP_BIT);
-      counter_y -= current_block->step_event_count;
-    }
-    counter_z += current_block->steps_z;
-    if (counter_z > 0) {
-      out_bits |= (1<<Z_STEP_BIT);
-      counter_z -= current_block->step_event_count;
-    }
-    // If current block is finished, reset pointer 
-    step_events_completed += 1;
-    if (step_events_completed >= current_block->step_event_count) {
-      current_block = NULL;
-      plan_discard_current_block();
+  } else if (ramp_events && current_segment->ramp != RAMP_CRUISE) {
+    // Move along the ramp by the step events traced last time
+    ramp_step(ramp_events);
+    restage = TRUE;
+  }
+
+  pulse_count = 0;
+  ramp_events = 0;
+  stepping = (current_segment != NULL && hold_state != HOLD_STOPPED);
+  if (stepping) {
+    // Trace one step event at a time during a feed hold, the pulses are too far apart for multi-stepping
+    uint8_t iterations = (hold_state == HOLD_OFF) ? 1 << current_segment->multi_step_level : 1;
+    if (restage || hold_state != HOLD_OFF) { stage_step_timer(current_segment, iterations); }
+    uint8_t iteration = 0;
+    for (;;) {
+      uint8_t bits = current_block->direction_bits;
+      counter_x += steps_x;
+      if (counter_x > 0) {
+        bits |= (1<<X_STEP_BIT);
+        counter_x -= event_count;
+        if (bits & (1<<X_DIRECTION_BIT)) { position[X_AXIS]--; } else { position[X_AXIS]++; }
+      }
+      counter_y += steps_y;
+      if (counter_y > 0) {
+        bits |= (1<<Y_STEP_BIT);
+        counter_y -= event_count;
+        if (bits & (1<<Y_DIRECTION_BIT)) { position[Y_AXIS]--; } else { position[Y_AXIS]++; }
+      }
+      counter_z += steps_z;
+      if (counter_z > 0) {
+        bits |= (1<<Z_STEP_BIT);
+        counter_z -= event_count;
+        if (bits & (1<<Z_DIRECTION_BIT)) { position[Z_AXIS]--; } else { position[Z_AXIS]++; }
+      }
+      if (iteration == 0) {
+        out_bits = bits;
+      } else {
+        pulse_bits[pulse_count++] = bits ^ settings.invert_mask;
+      }
+      // Once a whole step event is done, count it against the segment
+      if (--amass_ticks == 0) {
+        ramp_events++;
+        if (--current_segment->n_step == 0) {
+          // A segment ending part way through the interrupt only gets the time for the steps it traced
+          if (++iteration < iterations) { stage_step_timer(current_segment, iteration); }
+          // If current block is finished, reset pointer 
+          if (current_segment->end_of_block) {
+            current_block = NULL;
+            plan_discard_current_block();
+          }
+          current_segment = NULL;
+          if (++segment_buffer_tail == SEGMENT_BUFFER_SIZE) { segment_buffer_tail = 0; }
+          break;
+        }
+        amass_ticks = 1 << current_segment->amass_level;
+      }
+      if (++iteration == iterations) { break; }
     }
   } else {
     out_bits = 0;
   }          
+  // Coming out of standstill nothing was output, so time the first steps right away
+  if (!was_stepping) { set_step_timer(); }
   out_bits ^= settings.invert_mask;
-  
-  // In average this generates a trapezoid_generator_tick every CYCLES_PER_ACCELERATION_TICK by keeping track
-  // of the number of elapsed cycles. The code assumes that step_events occur significantly more often than
-  // trapezoid_generator_ticks as they well should. 
-  trapezoid_tick_cycle_counter += cycles_per_step_event;
-  if(trapezoid_tick_cycle_counter > CYCLES_PER_ACCELERATION_TICK) {
-    trapezoid_tick_cycle_counter -= CYCLES_PER_ACCELERATION_TICK;
-    trapezoid_generator_tick();
+  // Set the direction pins for the next steps right away, a full step interval ahead of the pulse. Keep The 
+  // Stepper Port Reset Interrupt out while changing the port. Pulses still queued for this interrupt need the
+  // old direction, then the last one sets the new one when it ends.
+  cli();
+  if (pulses_queued) {
+    next_direction_bits = out_bits & DIRECTION_MASK;
+    direction_pending = TRUE;
+  } else {
+    STEPPING_PORT = (STEPPING_PORT & ~DIRECTION_MASK) | (out_bits & DIRECTION_MASK);
   }
-  
   busy=FALSE;
 }
 
@@ -211,6 +538,20 @@ SIGNAL(TIMER2_OVF_vect)
 {
   // reset stepping pins (leave the direction pins)
   STEPPING_PORT = (STEPPING_PORT & ~STEP_MASK) | (settings.invert_mask & STEP_MASK); 
+  // After the last queued pulse set the direction pins for the next interrupt
+  if (direction_pending && !pulses_queued) {
+    STEPPING_PORT = (STEPPING_PORT & ~DIRECTION_MASK) | next_direction_bits;
+    direction_pending = FALSE;
+  }
+}
+
+// Outputs the queued pulses of a multi-step interrupt, one step interval apart. Enabled by 
+// SIG_OUTPUT_COMPARE1A while there are any.
+SIGNAL(TIMER2_COMPA_vect)
+{
+  start_step_pulse(pulse_queue[pulse_queue_index++]);
+  OCR2A = TCNT2+pulse_spacing;
+  if (--pulses_queued == 0) { TIMSK2 &= ~(1<<OCIE2A); }
 }
 
 // Initialize and start the stepper motor subsystem
@@ -247,9 +588,12 @@ void st_init()
   TCCR2B = (1<<CS21); // Full speed, 1/8 prescaler
   TIMSK2 |= (1<<TOIE2);      
   
-  set_step_events_per_minute(6000);
+  uint16_t ceiling;
+  uint8_t prescaler;
+  config_step_timer((TICKS_PER_MICROSECOND*1000000*60)/6000, &ceiling, &prescaler);
+  TCCR1B = (TCCR1B & ~(0x07<<CS10)) | prescaler;
+  OCR1A = ceiling;
   DISABLE_STEPPER_DRIVER_INTERRUPT();  
-  trapezoid_tick_cycle_counter = 0;
   
   // set enable pin     
   STEPPERS_ENABLE_PORT |= STEPPERS_ENABLE_SIGNAL<<STEPPERS_ENABLE_BIT;
@@ -260,12 +604,118 @@ void st_init()
 // Block until all buffered steps are executed
 void st_synchronize()
 {
-  while(plan_get_current_block()) { 
+  while(plan_get_current_block() && !(sp_execute & EXEC_RESET)) { 
+	  st_prep_buffer();
 	  st_pause_wait_resume();
 	  sleep_mode(); 
   }    
 }
 
+// Brings the steppers to a stop along the acceleration of the current block. Stops at once when acceleration
+// management is off.
+void st_feed_hold()
+{
+  if (hold_state == HOLD_DECELERATE || hold_state == HOLD_STOPPED) { return; }
+  cli();
+  // Between two segments the next one in the buffer is about to start
+  segment_t *segment = current_segment;
+  if (segment == NULL && segment_buffer_head != segment_buffer_tail) { segment = &segment_buffer[segment_buffer_tail]; }
+  if (!stepping || segment == NULL) {
+    // Nothing moving. Just keep whatever comes next from starting
+    hold_ramp_step = 0;
+    hold_state = HOLD_STOPPED;
+    sei();
+    return;
+  }
+  uint32_t interval = segment->interval;
+  if (hold_state == HOLD_ACCELERATE && hold_interval > interval) { interval = hold_interval; }
+  uint32_t acceleration = segment->block->acceleration;
+  sei();
+  uint32_t start_step = 0; // Without acceleration management just stop, and go on at full rate
+  if (acceleration) {
+    // The index of the current rate on a ramp from standstill
+    double rate = (TICKS_PER_MICROSECOND*1000000.0*60*(1<<INTERVAL_FRACTION_BITS))/interval;
+    start_step = max(lround(rate*rate/(2.0*acceleration)), 1);
+  }
+  cli();
+  hold_interval = interval;
+  hold_ramp_step = start_step;
+  hold_state = acceleration ? HOLD_DECELERATE : HOLD_STOPPED;
+  sei();
+}
+
+// Resumes after a feed hold, accelerating back up to the planned rates
+void st_cycle_start()
+{
+  cli();
+  if (hold_state == HOLD_DECELERATE || (hold_state == HOLD_STOPPED && hold_ramp_step)) {
+    hold_state = HOLD_ACCELERATE;
+  } else if (hold_state == HOLD_STOPPED) {
+    hold_state = HOLD_OFF;
+  }
+  sei();
+  st_wake_up();
+}
+
+// Returns TRUE while a feed hold is stopping or holding the steppers
+uint8_t st_is_held()
+{
+  return(hold_state == HOLD_DECELERATE || hold_state == HOLD_STOPPED);
+}
+
+// Copies the machine position in steps. It runs ahead of the step pulses by at most one interrupt.
+void st_get_position(int32_t *steps)
+{
+  cli();
+  memcpy(steps, position, sizeof(position));
+  sei();
+}
+
+// Sets the machine position in steps. Only call it while the steppers are idle.
+void st_set_position(int32_t *steps)
+{
+  cli();
+  memcpy(position, steps, sizeof(position));
+  sei();
+}
+
+// Returns the current step rate in step_events/minute, or 0 when not stepping
+uint32_t st_get_step_rate()
+{
+  uint32_t interval = 0;
+  cli();
+  if (stepping) {
+    segment_t *segment = current_segment;
+    if (segment == NULL) { segment = &segment_buffer[segment_buffer_tail]; }
+    interval = segment->interval;
+    if (hold_state != HOLD_OFF && hold_interval > interval) { interval = hold_interval; }
+  }
+  sei();
+  interval >>= INTERVAL_FRACTION_BITS;
+  if (interval == 0) { return(0); }
+  return((TICKS_PER_MICROSECOND*1000000*60)/interval);
+}
+
+// Stops the steppers at once and throws away all prepared segments. The planner must be reset as well.
+void st_reset()
+{
+  DISABLE_STEPPER_DRIVER_INTERRUPT();
+  TIMSK2 &= ~(1<<OCIE2A);
+  pulses_queued = 0;
+  direction_pending = FALSE;
+  segment_buffer_head = 0;
+  segment_buffer_tail = 0;
+  current_segment = NULL;
+  current_block = NULL;
+  prep_block = NULL;
+  pulse_count = 0;
+  ramp_events = 0;
+  stepping = FALSE;
+  hold_state = HOLD_OFF;
+  out_bits = settings.invert_mask;
+  clear_vector(position);
+}
+
 void st_pause_wait_resume()
 {
 //	if((LID_PIN & (1<<IS_ENCLOSURE_LID_OPEN_BIT)) == LID_IS_OPEN)
@@ -293,57 +743,47 @@ void st_pause_wait_resume()
 		while(TRUE)
 		{
 			// TODO_MM - Do I need to print power off here too or is it certain to get read?
-			printPgmString(PSTR("::power_off::\r\n"));
+			report_alarm_message(PSTR("::power_off::"));
 			_delay_ms(1000);
 		}
 	}
+	sp_execute_realtime();
 }
 
-// Configures the prescaler and ceiling of timer 1 to produce the given rate as accurately as possible.
-// Returns the actual number of cycles per interrupt
-uint32_t config_step_timer(uint32_t cycles)
+// Computes the prescaler and ceiling of timer 1 that produce the given rate as accurately as possible. The
+// prescaler is returned as the clock select bits for TCCR1B. Returns the actual number of cycles per interrupt
+uint32_t config_step_timer(uint32_t cycles, uint16_t *ceiling, uint8_t *prescaler)
 {
-  uint16_t ceiling;
-  uint16_t prescaler;
   uint32_t actual_cycles;
 	if (cycles <= 0xffffL) {
-		ceiling = cycles;
-    prescaler = 0; // prescaler: 0
-    actual_cycles = ceiling;
+		*ceiling = cycles;
+    *prescaler = 1<<CS10; // prescaler: 0
+    actual_cycles = *ceiling;
 	} else if (cycles <= 0x7ffffL) {
-    ceiling = cycles >> 3;
-    prescaler = 1; // prescaler: 8
-    actual_cycles = ceiling * 8L;
+    *ceiling = cycles >> 3;
+    *prescaler = 2<<CS10; // prescaler: 8
+    actual_cycles = *ceiling * 8L;
 	} else if (cycles <= 0x3fffffL) {
-		ceiling =  cycles >> 6;
-    prescaler = 2; // prescaler: 64
-    actual_cycles = ceiling * 64L;
+		*ceiling =  cycles >> 6;
+    *prescaler = 3<<CS10; // prescaler: 64
+    actual_cycles = *ceiling * 64L;
 	} else if (cycles <= 0xffffffL) {
-		ceiling =  (cycles >> 8);
-    prescaler = 3; // prescaler: 256
-    actual_cycles = ceiling * 256L;
+		*ceiling =  (cycles >> 8);
+    *prescaler = 4<<CS10; // prescaler: 256
+    actual_cycles = *ceiling * 256L;
 	} else if (cycles <= 0x3ffffffL) {
-		ceiling = (cycles >> 10);
-    prescaler = 4; // prescaler: 1024
-    actual_cycles = ceiling * 1024L;    
+		*ceiling = (cycles >> 10);
+    *prescaler = 5<<CS10; // prescaler: 1024
+    actual_cycles = *ceiling * 1024L;    
 	} else {
 	  // Okay, that was slower than we actually go. Just set the slowest speed
-		ceiling = 0xffff;
-    prescaler = 4;
-    actual_cycles = 0xffff * 1024;
+		*ceiling = 0xffff;
+    *prescaler = 5<<CS10;
+    actual_cycles = 0xffff * 1024L;
 	}
-	// Set prescaler
-  TCCR1B = (TCCR1B & ~(0x07<<CS10)) | ((prescaler+1)<<CS10);
-  // Set ceiling
-  OCR1A = ceiling;
   return(actual_cycles);
 }
 
-void set_step_events_per_minute(uint32_t steps_per_minute) {
-  if (steps_per_minute < MINIMUM_STEPS_PER_MINUTE) { steps_per_minute = MINIMUM_STEPS_PER_MINUTE; }
-  cycles_per_step_event = config_step_timer((TICKS_PER_MICROSECOND*1000000*60)/steps_per_minute);
-}
-
 void st_go_home()
 {
   // Todo: Perform the homing cycle
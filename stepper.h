@@ -37,6 +37,32 @@ void st_go_home();
 // to notify the subsystem that it is time to go to work.
 void st_wake_up();
 
+// Prepares step segments from the planned blocks for the stepper interrupt. Call it from the main loop and from 
+// every loop that waits for the stepper.
+void st_prep_buffer();
+
+// Checks the power and services the real-time commands. Call it from every loop that waits for the stepper.
 void st_pause_wait_resume();
 
+// Decelerates the steppers to a stop, keeping the rest of the plan
+void st_feed_hold();
+
+// Resumes the plan after a feed hold
+void st_cycle_start();
+
+// Returns TRUE while a feed hold is stopping or holding the steppers
+uint8_t st_is_held();
+
+// Stops the steppers immediately and discards the prepared steps. Used by the soft reset.
+void st_reset();
+
+// Copies the machine position in steps as maintained by the stepper interrupt
+void st_get_position(int32_t *steps);
+
+// Sets the machine position in steps. Only call it while the steppers are idle.
+void st_set_position(int32_t *steps);
+
+// Returns the current step rate in step_events/minute, or 0 when not stepping
+uint32_t st_get_step_rate();
+
 #endif
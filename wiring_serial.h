@@ -25,10 +25,43 @@
 #ifndef wiring_h
 #define wiring_h
 
-void beginSerial();
+#include <inttypes.h>
+
+// Starts the UART at the baud rate, or at BAUD_RATE if the UART can't run at that rate
+void beginSerial(unsigned long baud);
+// Returns 1 if the baud rate is within SERIAL_MAX_BAUD_ERROR of a rate the UART can run at
+int serialBaudRateUsable(unsigned long baud);
+unsigned long serialBaudRate(void);
+// Waits until everything written so far has been sent
+void serialDrain(void);
 void serialWrite(unsigned char);
+// Writes the byte without waiting. Returns 0 if the output buffer is full and the byte was not written.
+int serialTryWrite(unsigned char);
+// Returns the number of bytes serialTryWrite() can take right now
+int serialWriteAvailable(void);
 int serialAvailable(void);
-int serialRead(void);
+int serialRxFree(void);
+// A line too long for the line buffer reads as this byte alone
+#define SERIAL_LINE_TOO_LONG 0x02
+
+// Counts of what went wrong receiving since power up. The counts stop at 0xffff.
+typedef struct {
+  uint16_t overruns;       // Bytes the UART lost because the receive interrupt was held off too long
+  uint16_t framing_errors; // Bytes with a missing stop bit: noise or the wrong baud rate
+  uint16_t dropped;        // Bytes thrown away because their line was too long or did not fit the buffer
+  uint16_t rejected_lines; // Lines that were too long or did not fit the buffer
+  uint8_t peak;            // The most bytes the receive buffer has held
+} serial_health_t;
+
+// Copies the receive health counters
+void serialGetHealth(serial_health_t *health);
+
+// Returns the number of complete lines in the receive buffer
+int serialLineAvailable(void);
+// Copies the next complete line, without its line end, to line and returns its length. Returns -1 if there
+// is none. line must hold LINE_BUFFER_SIZE bytes.
+int serialReadLine(char *line);
+// Drops everything received so far. The receive interrupt does so itself on a reset (ctrl-x).
 void serialFlush(void);
 void printMode(int);
 void printByte(unsigned char c);
@@ -40,6 +73,9 @@ void printHex(unsigned long n);
 void printOctal(unsigned long n);
 void printBinary(unsigned long n);
 void printIntegerInBase(unsigned long n, unsigned long base);
+// Prints n rounded to the given number of decimals, e.g. printFloatDecimals(-0.05, 3) gives "-0.050"
+void printFloatDecimals(double n, uint8_t decimals);
+// Prints n to 3 decimals, to the micrometre for millimeters
 void printFloat(double n);
 
 void print_newline();